@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <assert.h>
 #include "sqlitejs.h"
 #include "quickjs.h"
@@ -23,16 +24,132 @@ SQLITE_EXTENSION_INIT1
 #define APIEXPORT
 #endif
 
+typedef struct functionjs_context functionjs_context;
+typedef struct jsstatement jsstatement;
+
+// indexes of the code pieces of an aggregate or window function
+#define FUNCTION_CODE_INIT              0
+#define FUNCTION_CODE_STEP              1
+#define FUNCTION_CODE_FINAL             2
+#define FUNCTION_CODE_VALUE             3
+#define FUNCTION_CODE_INVERSE           4
+#define FUNCTION_CODE_COUNT             5
+
+// json function flags: JSON arguments are parsed and objects are returned as JSON text or as JSONB
+#define JSON_MODE_TEXT                  1
+#define JSON_MODE_BINARY                2
+#define JSON_SUBTYPE                    74      // 'J', the subtype of the values returned by the SQLite JSON functions
+
+// collation flags: order of two ASCII strings resolved in C without calling the JS function
+#define COLLATION_ASCII_BINARY          1
+#define COLLATION_ASCII_NOCASE          2
+
+#define STMT_CACHE_BUCKETS              256     // power of 2, at most 4 statements per bucket on average at max capacity
+
+typedef struct jsstmt_entry {
+    struct jsstmt_entry *hnext;         // next entry in the same hash bucket
+    struct jsstmt_entry *prev;          // LRU list, head is the most recently used entry
+    struct jsstmt_entry *next;
+    uint64_t            hash;           // hash of the statement SQL text
+    sqlite3_stmt        *vm;            // to release, reset statement ready to be reused
+} jsstmt_entry;
+
+typedef struct {
+    jsstmt_entry        *buckets[STMT_CACHE_BUCKETS];
+    jsstmt_entry        *head;
+    jsstmt_entry        *tail;
+    int                 count;
+    int                 capacity;       // 0 means disabled
+    sqlite3_int64       hits;
+    sqlite3_int64       misses;
+} jsstmt_cache;
+
 typedef struct {
     JSRuntime           *runtime;
     JSContext           *context;
     sqlite3             *db;
     JSClassID           rowSetClassID;
+    JSClassID           statementClassID;
+    JSClassID           rowIteratorClassID;
     int                 ref_count;
+    functionjs_context  *functions;     // list of registered functions (not owned, each one is released by SQLite)
+    
+    JSAtom              *global_atoms;  // to release, global properties of a freshly initialized context (used to reset pooled contexts)
+    uint32_t            nglobal_atoms;
+    
+    jsstmt_cache        stmt_cache;     // prepared statements reused by db.exec
+    jsstatement         *statements;    // list of Statement objects created by db.prepare (not owned, released by their finalizer)
+    bool                trusted_bytecode; // bytecode persisted in js_functions is loaded instead of compiling the source code
+    bool                trusted_blobview; // blobview functions receive the SQLite memory of BLOB arguments instead of a copy
+    bool                close_hook;     // js_close_hook is connected (or connecting it already failed)
+    
+    int                 step_depth;     // statements currently stepped from JS by js_step
+    char                *pending_error; // to release, first collation error raised while js_step is running
 } globaljs_context;
 
+typedef struct jscache_entry {
+    struct jscache_entry    *hnext;     // next entry in the same hash bucket
+    struct jscache_entry    *prev;      // LRU list, head is the most recently used entry
+    struct jscache_entry    *next;
+    uint64_t                hash;
+    int                     nkey;       // size of the serialized key stored in data
+    int                     type;       // SQLite type of the cached value
+    sqlite3_int64           ivalue;
+    double                  dvalue;
+    int                     nvalue;     // size of the TEXT/BLOB value stored in data right after the key
+    unsigned char           data[];
+} jscache_entry;
+
+typedef struct {
+    jscache_entry       **buckets;
+    int                 nbuckets;       // always a power of 2
+    int                 count;
+    int                 capacity;
+    jscache_entry       *head;
+    jscache_entry       *tail;
+    sqlite3_int64       hits;
+    sqlite3_int64       misses;
+    
+    unsigned char       *key;           // scratch buffer used to serialize the lookup key
+    int                 nkey;
+    int                 key_alloc;
+    uint64_t            key_hash;
+} jscache;
+
+#define JSCACHE_SAVED_KEY_SIZE          128
+
+typedef struct {
+    unsigned char       *key;           // to release when it does not point to buffer
+    int                 nkey;
+    uint64_t            key_hash;
+    unsigned char       buffer[JSCACHE_SAVED_KEY_SIZE];
+} jscache_saved_key;
+
+typedef struct jspool_entry {
+    struct jspool_entry *next;
+    JSContext           *context;       // to release, isolated context with the globals of the previous group removed
+} jspool_entry;
+
 typedef struct {
+    int                 func_flags;     // SQLITE_DETERMINISTIC, SQLITE_INNOCUOUS and SQLITE_DIRECTONLY
+    int                 cache_size;     // capacity of the result cache, 0 means disabled (scalar only)
+    bool                state_mode;     // per-group state object passed to shared step/final functions (aggregate and window only)
+    int                 pool_size;      // max number of recycled isolated contexts, 0 means disabled (aggregate and window only)
+    bool                blob_view;      // BLOB arguments are passed as zero-copy views detached after the call (scalar only)
+    bool                bigint;         // INTEGER arguments outside the safe integer range are passed as BigInt
+    int                 result_type;    // declared result type (SQLITE_INTEGER or SQLITE_FLOAT), 0 means dynamic
+    uint64_t            date_args;      // bitmask of the arguments passed as Date (unix epoch seconds or ISO-8601 text)
+    int                 json_mode;      // JSON_MODE_TEXT or JSON_MODE_BINARY, 0 means disabled
+    bool                collation_key;  // the function returns a sort key cached per distinct string and compared in C (collation only)
+    int                 ascii_mode;     // COLLATION_ASCII_BINARY or COLLATION_ASCII_NOCASE, 0 means disabled (collation only)
+    bool                collation_abort; // an error interrupts all the statements running on the connection (collation only)
+} functionjs_options;
+
+struct functionjs_context {
     globaljs_context    *js_ctx;        // never to release
+    functionjs_context  *next;          // next function registered in js_ctx
+    const char          *name;          // to release
+    const char          *kind;          // static string, one of the FUNCTION_TYPE_* values
     
     const char          *init_code;     // release only if complete (aggregate functions only)
     const char          *step_code;     // release only if complete (scalar, collation, windows and aggregate functions)
@@ -40,11 +157,37 @@ typedef struct {
     const char          *value_code;    // release only if complete (window functions only)
     const char          *inverse_code;  // release only if complete (window functions only)
     
+    int                 nargs;          // fixed number of arguments passed positionally, -1 means variadic args array (scalar only)
+    functionjs_options  options;        // parsed from the flags parameter
+    jscache             *cache;         // to release (scalar only, NULL if disabled)
     JSValue             func;      // to release (scalar, collation)
-} functionjs_context;
+    
+    JSValue             init_func;      // to release (state mode only, optional state factory)
+    JSValue             step_func;      // to release (state mode only)
+    JSValue             final_func;     // to release (state mode only)
+    JSValue             value_func;     // to release (state mode only, window functions)
+    JSValue             inverse_func;   // to release (state mode only, window functions)
+    
+    uint8_t             *bytecode[FUNCTION_CODE_COUNT]; // to release, serialized bytecode (kept only in isolated mode, where it is read in each group context)
+    size_t              bytecode_size[FUNCTION_CODE_COUNT];
+    
+    bool                materialized;   // false until the code is compiled (lazy loading from the js_functions table)
+    void                *lazy_bytecode; // to release, persisted bytecode waiting for the first call (lazy loading only)
+    int                 lazy_bytecode_size;
+    
+    jspool_entry        *pool;          // to release, free-list of recycled aggregate contexts (isolated mode only)
+    int                 pool_count;
+    sqlite3_int64       pool_hits;
+    sqlite3_int64       pool_misses;
+    
+    char                *last_error;    // to release, message of the last error raised by a comparison or that disabled the pool
+    sqlite3_int64       errors;         // number of comparisons that failed, or 1 once the pool has been disabled
+};
 
 typedef struct {
-    JSContext           *context;       // to release (windows and aggregate functions)
+    JSContext           *context;       // to release only if owns_context (windows and aggregate functions)
+    bool                owns_context;   // false in state mode, where the global context is shared by all groups
+    JSValue             state;          // to release (state mode only, per-group state object)
     JSValue             step_func;      // to release (scalar, collation, windows and aggregate functions)
     JSValue             final_func;     // to release (windows and aggregate functions)
     JSValue             value_func;     // to release (window functions only)
@@ -53,20 +196,432 @@ typedef struct {
 
 static char *sqlite_strdup (const char *str);
 static bool js_global_init (JSContext *ctx, globaljs_context *js);
+static void js_global_reset (JSContext *ctx, globaljs_context *js);
 static JSValue sqlite_value_to_js (JSContext *ctx, sqlite3_value *value);
+static void js_error_to_sqlite (sqlite3_context *context, JSContext *js_ctx, JSValue value, const char *default_error);
+static bool js_number_is_integer (double d, sqlite3_int64 *n);
+static bool js_bigint_to_int64 (JSContext *ctx, JSValueConst value, sqlite3_int64 *n);
+static int js_bind_values (JSContext *ctx, sqlite3_stmt *vm, int argc, JSValueConst *argv);
 
 #define FUNCTION_TYPE_SCALAR            "scalar"
 #define FUNCTION_TYPE_WINDOW            "window"
 #define FUNCTION_TYPE_AGGREGATE         "aggregate"
 #define FUNCTION_TYPE_COLLATION         "collation"
 
+#define FUNCTION_NARGS_VARIADIC         -1
+#define FUNCTION_STACK_ARGS             16
+#define FUNCTION_CACHE_DEFAULT_SIZE     256
+#define FUNCTION_CACHE_MAX_SIZE         (1024*1024)
+#define FUNCTION_POOL_DEFAULT_SIZE      4
+#define FUNCTION_POOL_MAX_SIZE          1024
+#define COLLATION_KEY_CACHE_DEFAULT_SIZE 4096
+
+#define MAX_SAFE_INTEGER                9007199254740991LL  // 2^53 - 1, Number.MAX_SAFE_INTEGER
+
+#define ROWSET_BATCH_DEFAULT_SIZE       256
+#define ROWSET_BATCH_MAX_SIZE           16384
+#define ROWSET_BATCH_INITIAL_ROWS       64
+#define ROW_STACK_COLUMNS               32
+#define STMT_CACHE_MAX_SIZE             1024
+
+#define FUNCTION_LOAD_NONE              0
+#define FUNCTION_LOAD_EAGER             1
+#define FUNCTION_LOAD_LAZY              2
+
 #define SAFE_STRCMP(a,b)                (((a) != (b)) && ((a) == NULL || (b) == NULL || strcmp((a), (b)) != 0))
 
+// MARK: - Cache -
+
+static uint64_t fnv1a_hash (const void *bytes, size_t nbytes) {
+    const unsigned char *p = (const unsigned char *)bytes;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i=0; i<nbytes; ++i) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static jscache *jscache_create (int capacity) {
+    jscache *cache = (jscache *)sqlite3_malloc(sizeof(jscache));
+    if (!cache) return NULL;
+    memset(cache, 0, sizeof(jscache));
+    
+    int nbuckets = 16;
+    while (nbuckets < capacity) nbuckets <<= 1;
+    
+    cache->buckets = (jscache_entry **)sqlite3_malloc((int)(sizeof(jscache_entry *) * nbuckets));
+    if (!cache->buckets) {
+        sqlite3_free(cache);
+        return NULL;
+    }
+    memset(cache->buckets, 0, sizeof(jscache_entry *) * nbuckets);
+    
+    cache->nbuckets = nbuckets;
+    cache->capacity = capacity;
+    return cache;
+}
+
+static void jscache_free (jscache *cache) {
+    if (!cache) return;
+    
+    jscache_entry *entry = cache->head;
+    while (entry) {
+        jscache_entry *next = entry->next;
+        sqlite3_free(entry);
+        entry = next;
+    }
+    
+    if (cache->key) sqlite3_free(cache->key);
+    sqlite3_free(cache->buckets);
+    sqlite3_free(cache);
+}
+
+static bool jscache_key_reserve (jscache *cache, int size) {
+    if (cache->nkey + size <= cache->key_alloc) return true;
+    
+    int alloc = (cache->key_alloc) ? cache->key_alloc : 64;
+    while (alloc < cache->nkey + size) alloc <<= 1;
+    
+    unsigned char *key = (unsigned char *)sqlite3_realloc(cache->key, alloc);
+    if (!key) return false;
+    
+    cache->key = key;
+    cache->key_alloc = alloc;
+    return true;
+}
+
+static bool jscache_key_append (jscache *cache, int type, const void *bytes, int nbytes) {
+    // each key component is serialized as a type byte followed by its payload
+    // TEXT and BLOB payloads are prefixed by their length so that adjacent components cannot be confused
+    bool has_length = (type == SQLITE_TEXT || type == SQLITE_BLOB);
+    if (!jscache_key_reserve(cache, 1 + (has_length ? (int)sizeof(int) : 0) + nbytes)) return false;
+    
+    cache->key[cache->nkey++] = (unsigned char)type;
+    if (has_length) {
+        memcpy(cache->key + cache->nkey, &nbytes, sizeof(int));
+        cache->nkey += (int)sizeof(int);
+    }
+    if (nbytes) memcpy(cache->key + cache->nkey, bytes, nbytes);
+    cache->nkey += nbytes;
+    
+    return true;
+}
+
+static void jscache_key_hash (jscache *cache) {
+    cache->key_hash = fnv1a_hash(cache->key, (size_t)cache->nkey);
+}
+
+static bool jscache_key_values (jscache *cache, int nvalues, sqlite3_value **values) {
+    cache->nkey = 0;
+    
+    for (int i=0; i<nvalues; ++i) {
+        sqlite3_value *value = values[i];
+        bool rc = false;
+        
+        switch (sqlite3_value_type(value)) {
+            case SQLITE_INTEGER: {
+                sqlite3_int64 n = sqlite3_value_int64(value);
+                rc = jscache_key_append(cache, SQLITE_INTEGER, &n, sizeof(n));
+            } break;
+                
+            case SQLITE_FLOAT: {
+                double d = sqlite3_value_double(value);
+                rc = jscache_key_append(cache, SQLITE_FLOAT, &d, sizeof(d));
+            } break;
+                
+            case SQLITE_TEXT: {
+                const unsigned char *text = sqlite3_value_text(value);
+                rc = jscache_key_append(cache, SQLITE_TEXT, text, sqlite3_value_bytes(value));
+            } break;
+                
+            case SQLITE_BLOB: {
+                const void *blob = sqlite3_value_blob(value);
+                rc = jscache_key_append(cache, SQLITE_BLOB, blob, sqlite3_value_bytes(value));
+            } break;
+                
+            default:
+                rc = jscache_key_append(cache, SQLITE_NULL, NULL, 0);
+                break;
+        }
+        
+        if (!rc) return false;
+    }
+    
+    jscache_key_hash(cache);
+    return true;
+}
+
+static bool jscache_key_save (jscache *cache, jscache_saved_key *saved) {
+    // the scratch key is shared by all the calls of the function, a reentrant call (through db.exec)
+    // would overwrite it while the result of the outer call is computed
+    saved->nkey = cache->nkey;
+    saved->key_hash = cache->key_hash;
+    saved->key = (cache->nkey > JSCACHE_SAVED_KEY_SIZE) ? (unsigned char *)sqlite3_malloc(cache->nkey) : saved->buffer;
+    if (!saved->key) return false;
+    if (cache->nkey) memcpy(saved->key, cache->key, cache->nkey);
+    return true;
+}
+
+static void jscache_key_restore (jscache *cache, jscache_saved_key *saved) {
+    // the scratch buffer never shrinks, so it can always hold a key that was serialized in it
+    if (saved->nkey) memcpy(cache->key, saved->key, saved->nkey);
+    cache->nkey = saved->nkey;
+    cache->key_hash = saved->key_hash;
+    if (saved->key != saved->buffer) sqlite3_free(saved->key);
+    saved->key = NULL;
+}
+
+static void jscache_unlink (jscache *cache, jscache_entry *entry) {
+    if (entry->prev) entry->prev->next = entry->next;
+    else cache->head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else cache->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void jscache_link_head (jscache *cache, jscache_entry *entry) {
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head) cache->head->prev = entry;
+    cache->head = entry;
+    if (!cache->tail) cache->tail = entry;
+}
+
+static jscache_entry *jscache_lookup (jscache *cache) {
+    // lookup the key previously serialized in the scratch buffer
+    jscache_entry *entry = cache->buckets[cache->key_hash & (cache->nbuckets - 1)];
+    while (entry) {
+        if (entry->hash == cache->key_hash && entry->nkey == cache->nkey && memcmp(entry->data, cache->key, cache->nkey) == 0) break;
+        entry = entry->hnext;
+    }
+    
+    if (!entry) {
+        cache->misses++;
+        return NULL;
+    }
+    
+    cache->hits++;
+    if (entry != cache->head) {
+        jscache_unlink(cache, entry);
+        jscache_link_head(cache, entry);
+    }
+    return entry;
+}
+
+static void jscache_evict (jscache *cache) {
+    jscache_entry *entry = cache->tail;
+    if (!entry) return;
+    
+    jscache_entry **p = &cache->buckets[entry->hash & (cache->nbuckets - 1)];
+    while (*p != entry) p = &(*p)->hnext;
+    *p = entry->hnext;
+    
+    jscache_unlink(cache, entry);
+    sqlite3_free(entry);
+    cache->count--;
+}
+
+static jscache_entry *jscache_insert (jscache *cache, int type, sqlite3_int64 ivalue, double dvalue, const void *bytes, int nbytes) {
+    // insert the value using the key previously serialized in the scratch buffer
+    if (type != SQLITE_TEXT && type != SQLITE_BLOB) nbytes = 0;
+    
+    jscache_entry *entry = (jscache_entry *)sqlite3_malloc((int)(sizeof(jscache_entry) + cache->nkey + nbytes));
+    if (!entry) return NULL;
+    
+    if (cache->count >= cache->capacity) jscache_evict(cache);
+    
+    entry->hash = cache->key_hash;
+    entry->nkey = cache->nkey;
+    entry->type = type;
+    entry->ivalue = ivalue;
+    entry->dvalue = dvalue;
+    entry->nvalue = nbytes;
+    memcpy(entry->data, cache->key, cache->nkey);
+    if (nbytes) memcpy(entry->data + cache->nkey, bytes, nbytes);
+    
+    jscache_entry **bucket = &cache->buckets[entry->hash & (cache->nbuckets - 1)];
+    entry->hnext = *bucket;
+    *bucket = entry;
+    jscache_link_head(cache, entry);
+    cache->count++;
+    
+    return entry;
+}
+
+static void jscache_result (sqlite3_context *context, jscache_entry *entry) {
+    const void *value = entry->data + entry->nkey;
+    
+    switch (entry->type) {
+        case SQLITE_INTEGER: sqlite3_result_int64(context, entry->ivalue); break;
+        case SQLITE_FLOAT: sqlite3_result_double(context, entry->dvalue); break;
+        case SQLITE_TEXT: sqlite3_result_text(context, (const char *)value, entry->nvalue, SQLITE_TRANSIENT); break;
+        case SQLITE_BLOB: sqlite3_result_blob(context, value, entry->nvalue, SQLITE_TRANSIENT); break;
+        default: sqlite3_result_null(context); break;
+    }
+}
+
+// MARK: - Statement Cache -
+
+// Statements used by db.exec are checked out of the cache while a Rowset is using them and
+// returned (reset and with cleared bindings) when the Rowset is done, so a statement is never
+// shared by two live Rowsets. Cached statements would keep the connection busy, so they are
+// finalized by the close hook (see Connection Teardown) before sqlite3_close() checks for them.
+
+static void jsstmt_cache_unlink (jsstmt_cache *cache, jsstmt_entry *entry) {
+    jsstmt_entry **p = &cache->buckets[entry->hash & (STMT_CACHE_BUCKETS - 1)];
+    while (*p != entry) p = &(*p)->hnext;
+    *p = entry->hnext;
+    
+    if (entry->prev) entry->prev->next = entry->next; else cache->head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev; else cache->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+    cache->count--;
+}
+
+static void jsstmt_cache_trim (jsstmt_cache *cache, int capacity) {
+    while (cache->count > capacity && cache->tail) {
+        jsstmt_entry *entry = cache->tail;
+        jsstmt_cache_unlink(cache, entry);
+        sqlite3_finalize(entry->vm);
+        sqlite3_free(entry);
+    }
+}
+
+static jsstmt_entry *jsstmt_cache_lookup (jsstmt_cache *cache, const char *sql, uint64_t hash) {
+    for (jsstmt_entry *entry = cache->buckets[hash & (STMT_CACHE_BUCKETS - 1)]; entry; entry = entry->hnext) {
+        if (entry->hash == hash && strcmp(sqlite3_sql(entry->vm), sql) == 0) return entry;
+    }
+    return NULL;
+}
+
+static int jsstmt_prepare (sqlite3 *db, jsstmt_cache *cache, const char *sql, sqlite3_stmt **vm) {
+    if (cache->capacity == 0) return sqlite3_prepare_v2(db, sql, -1, vm, NULL);
+    
+    jsstmt_entry *entry = jsstmt_cache_lookup(cache, sql, fnv1a_hash(sql, strlen(sql)));
+    if (entry) {
+        cache->hits++;
+        jsstmt_cache_unlink(cache, entry);
+        *vm = entry->vm;
+        sqlite3_free(entry);
+        return SQLITE_OK;
+    }
+    
+    cache->misses++;
+    return sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, vm, NULL);
+}
+
+static void jsstmt_release (jsstmt_cache *cache, sqlite3_stmt *vm) {
+    if (!vm) return;
+    if (cache->capacity == 0) {
+        sqlite3_finalize(vm);
+        return;
+    }
+    
+    // keep only one copy of each statement
+    const char *sql = sqlite3_sql(vm);
+    uint64_t hash = fnv1a_hash(sql, strlen(sql));
+    jsstmt_entry *entry = (jsstmt_cache_lookup(cache, sql, hash)) ? NULL : (jsstmt_entry *)sqlite3_malloc(sizeof(jsstmt_entry));
+    if (!entry) {
+        sqlite3_finalize(vm);
+        return;
+    }
+    
+    sqlite3_reset(vm);
+    sqlite3_clear_bindings(vm);
+    
+    jsstmt_entry **bucket = &cache->buckets[hash & (STMT_CACHE_BUCKETS - 1)];
+    entry->hnext = *bucket;
+    *bucket = entry;
+    
+    entry->hash = hash;
+    entry->vm = vm;
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head) cache->head->prev = entry;
+    cache->head = entry;
+    if (!cache->tail) cache->tail = entry;
+    cache->count++;
+    
+    jsstmt_cache_trim(cache, cache->capacity);
+}
+
+// MARK: - Bytecode -
+
+// Serialized bytecode is persisted in js_functions as a single BLOB made of FUNCTION_CODE_COUNT
+// pieces, each one stored as: source hash (uint64), bytecode size (uint32), bytecode bytes.
+// Values are written in native byte order, the bytecode tag records everything the format depends on.
+
+#define BYTECODE_TAG_SIZE               64
+#define BYTECODE_PIECE_HEADER           (sizeof(uint64_t) + sizeof(uint32_t))
+
+static void js_bytecode_tag (char tag[BYTECODE_TAG_SIZE]) {
+    uint16_t one = 1;
+    bool little_endian = (*(uint8_t *)&one == 1);
+    sqlite3_snprintf(BYTECODE_TAG_SIZE, tag, "quickjs-%s-%d%s", JS_GetVersion(), (int)(sizeof(void *) * 8), (little_endian) ? "le" : "be");
+}
+
+static uint64_t js_bytecode_source_hash (const char *code) {
+    return (code) ? fnv1a_hash(code, strlen(code)) : 0;
+}
+
+static void *js_bytecode_pack (uint8_t *bytecode[FUNCTION_CODE_COUNT], size_t bytecode_size[FUNCTION_CODE_COUNT], const char *code[FUNCTION_CODE_COUNT], int *size) {
+    size_t total = 0;
+    for (int i=0; i<FUNCTION_CODE_COUNT; ++i) {
+        total += BYTECODE_PIECE_HEADER + ((bytecode[i]) ? bytecode_size[i] : 0);
+    }
+    if (total > INT_MAX) return NULL;
+    
+    uint8_t *blob = (uint8_t *)sqlite3_malloc((int)total);
+    if (!blob) return NULL;
+    
+    uint8_t *p = blob;
+    for (int i=0; i<FUNCTION_CODE_COUNT; ++i) {
+        uint64_t hash = js_bytecode_source_hash(code[i]);
+        uint32_t len = (bytecode[i]) ? (uint32_t)bytecode_size[i] : 0;
+        memcpy(p, &hash, sizeof(hash)); p += sizeof(hash);
+        memcpy(p, &len, sizeof(len)); p += sizeof(len);
+        if (len) {memcpy(p, bytecode[i], len); p += len;}
+    }
+    
+    *size = (int)total;
+    return blob;
+}
+
+static bool js_bytecode_unpack (const void *blob, int size, const char *code[FUNCTION_CODE_COUNT], const uint8_t *bytecode[FUNCTION_CODE_COUNT], size_t bytecode_size[FUNCTION_CODE_COUNT]) {
+    // a piece is returned only if it was compiled from exactly the same source code
+    const uint8_t *p = (const uint8_t *)blob;
+    const uint8_t *end = p + size;
+    
+    for (int i=0; i<FUNCTION_CODE_COUNT; ++i) {
+        bytecode[i] = NULL;
+        bytecode_size[i] = 0;
+    }
+    
+    for (int i=0; i<FUNCTION_CODE_COUNT; ++i) {
+        uint64_t hash;
+        uint32_t len;
+        if ((size_t)(end - p) < BYTECODE_PIECE_HEADER) return false;
+        memcpy(&hash, p, sizeof(hash)); p += sizeof(hash);
+        memcpy(&len, p, sizeof(len)); p += sizeof(len);
+        if ((size_t)(end - p) < len) return false;
+        
+        if (code[i] && len && hash == js_bytecode_source_hash(code[i])) {
+            bytecode[i] = p;
+            bytecode_size[i] = len;
+        }
+        p += len;
+    }
+    
+    return true;
+}
+
 // MARK: - RowSet -
 
 typedef struct {
     int             ncols;
     sqlite3_stmt    *vm;
+    JSAtom          *atoms;         // to release, column names interned on first use by toObjects and object
 } rowset;
 
 static void js_rowset_finalizer(JSRuntime *rt, JSValue val);
@@ -74,6 +629,11 @@ static JSValue js_rowset_next(JSContext *ctx, JSValueConst this_val, int argc, J
 static JSValue js_rowset_get(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv);
 static JSValue js_rowset_name(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv);
 static JSValue js_rowset_to_array(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv);
+static JSValue js_rowset_to_objects(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv);
+static JSValue js_rowset_object(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv);
+static JSValue js_rowset_to_columns(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv);
+static JSValue js_rowset_next_batch(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv);
+static JSValue js_rowset_rows(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv);
 
 // Define the Rowset class
 static const JSClassDef js_rowset_class = {
@@ -87,16 +647,82 @@ static const JSCFunctionListEntry js_rowset_proto_funcs[] = {
     JS_CFUNC_DEF("get", 1, js_rowset_get),
     JS_CFUNC_DEF("name", 1, js_rowset_name),
     JS_CFUNC_DEF("toArray", 0, js_rowset_to_array),
+    JS_CFUNC_DEF("toObjects", 0, js_rowset_to_objects),
+    JS_CFUNC_DEF("object", 0, js_rowset_object),
+    JS_CFUNC_DEF("toColumns", 0, js_rowset_to_columns),
+    JS_CFUNC_DEF("nextBatch", 1, js_rowset_next_batch),
+    JS_CFUNC_DEF("rows", 0, js_rowset_rows),
+    JS_CFUNC_DEF("[Symbol.iterator]", 0, js_rowset_rows),
+};
+
+typedef struct {
+    JSValue         rowset;         // to release, iterated Rowset
+    JSValue         row;            // to release, row object reused by every step (JS_UNDEFINED when not reusing)
+    bool            reuse;
+    bool            objects;
+} rowiterator;
+
+static void js_rowiterator_finalizer(JSRuntime *rt, JSValue val);
+static void js_rowiterator_mark(JSRuntime *rt, JSValueConst val, JS_MarkFunc *mark_func);
+static JSValue js_rowiterator_next(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv, int *pdone, int magic);
+static JSValue js_rowiterator_return(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv);
+static JSValue js_rowiterator_iterator(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv);
+
+// Define the RowIterator class (returned by Rowset.rows and Rowset[Symbol.iterator])
+static const JSClassDef js_rowiterator_class = {
+    "RowIterator",
+    .finalizer = js_rowiterator_finalizer,
+    .gc_mark = js_rowiterator_mark,
+};
+
+static const JSCFunctionListEntry js_rowiterator_proto_funcs[] = {
+    JS_ITERATOR_NEXT_DEF("next", 0, js_rowiterator_next, 0),
+    JS_CFUNC_DEF("return", 0, js_rowiterator_return),
+    JS_CFUNC_DEF("[Symbol.iterator]", 0, js_rowiterator_iterator),
 };
 
+static int js_step (JSContext *ctx, sqlite3_stmt *vm) {
+    // a collation that fails while a statement is stepped from JS does not interrupt the connection, its error is
+    // recorded in pending_error and thrown here (-1 is returned) even if SQLite produced a row or completed;
+    // the error of an outer statement stepping this one through a JS function is preserved
+    globaljs_context *js = JS_GetContextOpaque(ctx);
+    char *outer_error = js->pending_error;
+    js->pending_error = NULL;
+    
+    ++js->step_depth;
+    int rc = sqlite3_step(vm);
+    --js->step_depth;
+    
+    if (js->pending_error) {
+        JS_ThrowInternalError(ctx, "%s", js->pending_error);
+        sqlite3_free(js->pending_error);
+        sqlite3_reset(vm);
+        rc = -1;
+    }
+    js->pending_error = outer_error;
+    return rc;
+}
+
+static JSValue js_rowset_dberror (JSContext *ctx, globaljs_context *js, rowset *rs, int rc) {
+    // the error is thrown before releasing the statement, reset would otherwise replace the message
+    JSValue result = (rc == -1) ? JS_EXCEPTION : JS_ThrowInternalError(ctx, "%s", sqlite3_errmsg(sqlite3_db_handle(rs->vm)));
+    jsstmt_release(&js->stmt_cache, rs->vm);
+    rs->vm = NULL;
+    return result;
+}
+
 static JSValue js_rowset_next(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
     globaljs_context *js = JS_GetContextOpaque(ctx);
     rowset *rs = JS_GetOpaque(this_val, js->rowSetClassID);
     if (!rs) return JS_EXCEPTION;
     
-    if (sqlite3_step(rs->vm) == SQLITE_ROW) return JS_TRUE;
+    if (!rs->vm) return JS_FALSE;
+    
+    int rc = js_step(ctx, rs->vm);
+    if (rc == SQLITE_ROW) return JS_TRUE;
+    if (rc != SQLITE_DONE) return js_rowset_dberror(ctx, js, rs, rc);
     
-    sqlite3_finalize(rs->vm);
+    jsstmt_release(&js->stmt_cache, rs->vm);
     rs->vm = NULL;
     return JS_FALSE;
 }
@@ -129,6 +755,34 @@ static JSValue js_rowset_name(JSContext *ctx, JSValueConst this_val, int argc, J
     return JS_NewString(ctx, name);
 }
 
+static JSValue js_array_from (JSContext *ctx, JSValue *values, int count) {
+    // values are moved into a fast array with a single copy (JS_NewArrayFrom does not release them on failure)
+    if (count == 0) return JS_NewArray(ctx);
+    JSValue array = JS_NewArrayFrom(ctx, count, values);
+    if (JS_IsException(array)) {
+        for (int i=0; i<count; ++i) JS_FreeValue(ctx, values[i]);
+    }
+    return array;
+}
+
+static JSValue js_row_to_array (JSContext *ctx, sqlite3_stmt *vm, int ncols) {
+    JSValue stack_values[ROW_STACK_COLUMNS] = {0};
+    JSValue *values = stack_values;
+    if (ncols == 0) return JS_NewArray(ctx);
+    if (ncols > ROW_STACK_COLUMNS) {
+        values = (JSValue *)sqlite3_malloc64(sizeof(JSValue) * ncols);
+        if (!values) return JS_ThrowOutOfMemory(ctx);
+    }
+    
+    for (int i=0; i<ncols; ++i) {
+        values[i] = sqlite_value_to_js(ctx, sqlite3_column_value(vm, i));
+    }
+    
+    JSValue row = js_array_from(ctx, values, ncols);
+    if (values != stack_values) sqlite3_free(values);
+    return row;
+}
+
 static JSValue js_rowset_to_array(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
     globaljs_context *js = JS_GetContextOpaque(ctx);
     rowset *rs = JS_GetOpaque(this_val, js->rowSetClassID);
@@ -137,85 +791,950 @@ static JSValue js_rowset_to_array(JSContext *ctx, JSValueConst this_val, int arg
     JSValue result = JS_NewArray(ctx);
     if (JS_IsException(result)) return JS_EXCEPTION;
     
+    if (!rs->vm) return result;
+    
     int ncols = rs->ncols;
     int nrows = 0;
     while (true) {
-        int rc = sqlite3_step(rs->vm);
-        if (rc != SQLITE_ROW) break;
-        
-        JSValue row = JS_NewArray(ctx);
-        if (JS_IsException(row)) return JS_EXCEPTION;
+        int rc = js_step(ctx, rs->vm);
+        if (rc == SQLITE_DONE) break;
+        if (rc != SQLITE_ROW) {
+            JS_FreeValue(ctx, result);
+            return js_rowset_dberror(ctx, js, rs, rc);
+        }
         
-        for (int i=0; i<ncols; ++i) {
-            sqlite3_value *value = sqlite3_column_value(rs->vm, i);
-            JSValue jvalue = sqlite_value_to_js(ctx, value);
-            JS_SetPropertyUint32(ctx, row, i, jvalue);
+        JSValue row = js_row_to_array(ctx, rs->vm, ncols);
+        if (JS_IsException(row)) {
+            JS_FreeValue(ctx, result);
+            return JS_EXCEPTION;
         }
         
         JS_SetPropertyUint32(ctx, result, nrows++, row);
     }
     
-    sqlite3_finalize(rs->vm);
+    jsstmt_release(&js->stmt_cache, rs->vm);
     rs->vm = NULL;
     return result;
 }
 
-static void js_rowset_finalizer(JSRuntime *rt, JSValue val) {
-    globaljs_context *js = JS_GetRuntimeOpaque(rt);
-    rowset *rs = (rowset *)JS_GetOpaque(val, js->rowSetClassID);
-    if (!rs) return;
+static JSValue js_rowset_next_batch(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    globaljs_context *js = JS_GetContextOpaque(ctx);
+    rowset *rs = JS_GetOpaque(this_val, js->rowSetClassID);
+    if (!rs) return JS_EXCEPTION;
     
-    if (rs->vm) sqlite3_finalize(rs->vm);
-    sqlite3_free(rs);
+    // steps up to n rows in a single call, an empty array means that there are no more rows
+    // with flat set the values of all the rows are returned in a single row-major array (no per-row allocation)
+    int64_t n = ROWSET_BATCH_DEFAULT_SIZE;
+    if (argc > 0 && !JS_IsUndefined(argv[0])) {
+        if (JS_ToInt64(ctx, &n, argv[0]) < 0) return JS_EXCEPTION;
+        if (n < 1 || n > ROWSET_BATCH_MAX_SIZE) return JS_ThrowRangeError(ctx, "Batch size must be between 1 and %d", ROWSET_BATCH_MAX_SIZE);
+    }
+    bool flat = (argc > 1) ? JS_ToBool(ctx, argv[1]) : false;
+    if (!rs->vm || (flat && rs->ncols == 0)) return JS_NewArray(ctx);
+    
+    // the buffer grows as rows arrive, a large n on a short result does not allocate n rows up front
+    int64_t width = (flat) ? rs->ncols : 1;
+    int64_t limit = n * width;
+    int64_t capacity = ((n < ROWSET_BATCH_INITIAL_ROWS) ? n : ROWSET_BATCH_INITIAL_ROWS) * width;
+    JSValue *values = (JSValue *)sqlite3_malloc64(sizeof(JSValue) * capacity);
+    if (!values) return JS_ThrowOutOfMemory(ctx);
+    
+    int count = 0;
+    while (count < limit) {
+        if (count + width > capacity) {
+            int64_t size = (capacity * 2 < limit) ? capacity * 2 : limit;
+            JSValue *grown = (JSValue *)sqlite3_realloc64(values, sizeof(JSValue) * size);
+            if (!grown) {
+                JS_ThrowOutOfMemory(ctx);
+                goto abort_batch;
+            }
+            values = grown;
+            capacity = size;
+        }
+        
+        int rc = js_step(ctx, rs->vm);
+        if (rc == SQLITE_DONE) {
+            jsstmt_release(&js->stmt_cache, rs->vm);
+            rs->vm = NULL;
+            break;
+        }
+        if (rc != SQLITE_ROW) {
+            js_rowset_dberror(ctx, js, rs, rc);
+            goto abort_batch;
+        }
+        
+        if (flat) {
+            for (int i=0; i<rs->ncols; ++i) {
+                JSValue value = sqlite_value_to_js(ctx, sqlite3_column_value(rs->vm, i));
+                if (JS_IsException(value)) goto abort_batch;
+                values[count++] = value;
+            }
+            continue;
+        }
+        
+        JSValue row = js_row_to_array(ctx, rs->vm, rs->ncols);
+        if (JS_IsException(row)) goto abort_batch;
+        values[count++] = row;
+    }
+    
+    JSValue result = js_array_from(ctx, values, count);
+    sqlite3_free(values);
+    return result;
+    
+abort_batch:
+    for (int i=0; i<count; ++i) JS_FreeValue(ctx, values[i]);
+    sqlite3_free(values);
+    return JS_EXCEPTION;
 }
 
-// MARK: - Initializer -
-
-static globaljs_context *globaljs_init (sqlite3 *db) {
-    JSRuntime *rt = NULL;
-    JSContext *ctx = NULL;
-    
-    globaljs_context *js = (globaljs_context *)sqlite3_malloc(sizeof(globaljs_context));
-    if (!js) return NULL;
-    memset(js, 0, sizeof(globaljs_context));
+static bool js_rowset_atoms (JSContext *ctx, rowset *rs) {
+    // column names are interned only once per statement
+    if (rs->atoms || rs->ncols == 0) return true;
+    
+    JSAtom *atoms = (JSAtom *)sqlite3_malloc(sizeof(JSAtom) * rs->ncols);
+    if (!atoms) return false;
+    
+    for (int i=0; i<rs->ncols; ++i) {
+        const char *name = sqlite3_column_name(rs->vm, i);
+        atoms[i] = JS_NewAtom(ctx, (name) ? name : "");
+        if (atoms[i] == JS_ATOM_NULL) {
+            for (int j=0; j<i; ++j) JS_FreeAtom(ctx, atoms[j]);
+            sqlite3_free(atoms);
+            return false;
+        }
+    }
     
-    rt = JS_NewRuntime();
-    if (!rt) goto abort_init;
+    rs->atoms = atoms;
+    return true;
+}
+
+static JSValue js_row_to_object (JSContext *ctx, sqlite3_stmt *vm, int ncols, JSAtom *atoms) {
+    // properties are always added in the same order with the same interned atoms, so after the first row
+    // every shape transition is found in the runtime shape cache and all the rows share the same shape
+    JSValue row = JS_NewObject(ctx);
+    if (JS_IsException(row)) return JS_EXCEPTION;
+    
+    for (int i=0; i<ncols; ++i) {
+        JSValue value = sqlite_value_to_js(ctx, sqlite3_column_value(vm, i));
+        if (JS_DefinePropertyValue(ctx, row, atoms[i], value, JS_PROP_C_W_E) < 0) {
+            JS_FreeValue(ctx, row);
+            return JS_EXCEPTION;
+        }
+    }
     
-    //JS_SetMemoryLimit(rt, 80 * 1024);
-    //JS_SetMaxStackSize(rt, 10 * 1024);
+    return row;
+}
+
+static JSValue js_rowset_object(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    (void)argc; (void)argv;
+    globaljs_context *js = JS_GetContextOpaque(ctx);
+    rowset *rs = JS_GetOpaque(this_val, js->rowSetClassID);
+    if (!rs) return JS_EXCEPTION;
+    if (!rs->vm) return JS_ThrowTypeError(ctx, "Rowset has no current row");
     
-    js_std_init_handlers(rt);
-    JS_SetModuleLoaderFunc(rt, NULL, js_module_loader, NULL);
+    if (!js_rowset_atoms(ctx, rs)) return JS_ThrowOutOfMemory(ctx);
+    return js_row_to_object(ctx, rs->vm, rs->ncols, rs->atoms);
+}
+
+static JSValue js_rowset_to_objects(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    (void)argc; (void)argv;
+    globaljs_context *js = JS_GetContextOpaque(ctx);
+    rowset *rs = JS_GetOpaque(this_val, js->rowSetClassID);
+    if (!rs) return JS_EXCEPTION;
     
-    ctx = JS_NewContext(rt);
-    if (!ctx) goto abort_init;
+    JSValue result = JS_NewArray(ctx);
+    if (JS_IsException(result)) return JS_EXCEPTION;
+    if (!rs->vm) return result;
     
-    js->db = db;
-    js->runtime = rt;
-    js->context = ctx;
-    js->ref_count = 0;
+    if (!js_rowset_atoms(ctx, rs)) {
+        JS_FreeValue(ctx, result);
+        return JS_ThrowOutOfMemory(ctx);
+    }
     
-    JS_SetContextOpaque(ctx, js);
-    JS_SetRuntimeOpaque(rt, js);
-    js_global_init(ctx, js);
+    int rc;
+    uint32_t nrows = 0;
+    while ((rc = js_step(ctx, rs->vm)) == SQLITE_ROW) {
+        JSValue row = js_row_to_object(ctx, rs->vm, rs->ncols, rs->atoms);
+        if (JS_IsException(row)) {
+            JS_FreeValue(ctx, result);
+            return JS_EXCEPTION;
+        }
+        JS_SetPropertyUint32(ctx, result, nrows++, row);
+    }
     
-    return js;
+    if (rc != SQLITE_DONE) {
+        JS_FreeValue(ctx, result);
+        return js_rowset_dberror(ctx, js, rs, rc);
+    }
     
-abort_init:
-    if (rt) JS_FreeRuntime(rt);
-    if (ctx) JS_FreeContext(ctx);
-    if (js) sqlite3_free(js);
-    return NULL;
+    jsstmt_release(&js->stmt_cache, rs->vm);
+    rs->vm = NULL;
+    return result;
 }
 
-static void globaljs_free (globaljs_context *js) {
-    if (!js) return;
+typedef struct {
+    int             types;          // bitmask of the SQLite types found in the column (1 << SQLITE_INTEGER, ...)
+    bool            as_real;        // numeric values are stored as doubles instead of int64
+    bool            exact;          // every integer can be converted to a double without loss
+    uint8_t         *numbers;       // to release (unless moved to a typed array), 8 bytes per row allocated on the first numeric value
+    uint8_t         *nulls;         // to release (unless moved to a typed array), one bit per row set for NULL values
+    JSValue         values;         // to release, array of JS values (filled only for columns with TEXT or BLOB values)
+    sqlite3_uint64  nvalues;        // number of rows already stored in values
+} jscolumn;
 
-    // order matters
-    if (js->runtime) js_std_free_handlers(js->runtime);
-    if (js->context) JS_FreeContext(js->context);
-    if (js->runtime) JS_FreeRuntime(js->runtime);
+#define JSCOLUMN_MAX_EXACT_INTEGER  9007199254740992LL  // 2^53
+
+static void js_column_free_buffer (JSRuntime *rt, void *opaque, void *ptr) {
+    (void)rt; (void)opaque;
+    sqlite3_free(ptr);
+}
+
+static bool js_columns_grow (jscolumn *columns, int ncols, sqlite3_uint64 capacity, sqlite3_uint64 new_capacity) {
+    for (int i=0; i<ncols; ++i) {
+        jscolumn *c = &columns[i];
+        
+        uint8_t *nulls = (uint8_t *)sqlite3_realloc64(c->nulls, (new_capacity + 7) / 8);
+        if (!nulls) return false;
+        memset(nulls + (capacity + 7) / 8, 0, (new_capacity + 7) / 8 - (capacity + 7) / 8);
+        c->nulls = nulls;
+        
+        if (c->numbers) {
+            uint8_t *numbers = (uint8_t *)sqlite3_realloc64(c->numbers, new_capacity * 8);
+            if (!numbers) return false;
+            memset(numbers + capacity * 8, 0, (new_capacity - capacity) * 8);
+            c->numbers = numbers;
+        }
+    }
+    return true;
+}
+
+static bool js_column_fill (JSContext *ctx, jscolumn *c, sqlite3_uint64 nrows) {
+    // store the NULL and numeric rows in values, so the array is always dense
+    for (sqlite3_uint64 i=c->nvalues; i<nrows; ++i) {
+        JSValue v = JS_NULL;
+        if (!(c->nulls[i / 8] & (1 << (i % 8))) && c->numbers) {
+            if (c->as_real) {
+                double d;
+                memcpy(&d, c->numbers + i * 8, 8);
+                v = JS_NewFloat64(ctx, d);
+            } else {
+                // same representation as toArray and toObjects, only integer columns keep 64-bit values in a BigInt64Array
+                int64_t n;
+                memcpy(&n, c->numbers + i * 8, 8);
+                v = JS_NewInt64(ctx, n);
+            }
+        }
+        if (JS_SetPropertyInt64(ctx, c->values, (int64_t)i, v) < 0) return false;
+    }
+    if (nrows > c->nvalues) c->nvalues = nrows;
+    return true;
+}
+
+static bool js_column_append (JSContext *ctx, jscolumn *c, sqlite3_value *value, sqlite3_uint64 row, sqlite3_uint64 capacity) {
+    int type = sqlite3_value_type(value);
+    int text = (1 << SQLITE_TEXT) | (1 << SQLITE_BLOB);
+    c->types |= (1 << type);
+    
+    if (type == SQLITE_TEXT || type == SQLITE_BLOB) {
+        if (!js_column_fill(ctx, c, row)) return false;
+        JSValue v = sqlite_value_to_js(ctx, value);
+        if (JS_IsException(v)) return false;
+        if (JS_SetPropertyInt64(ctx, c->values, (int64_t)row, v) < 0) return false;
+        c->nvalues = row + 1;
+        return true;
+    }
+    
+    if (type == SQLITE_NULL) {
+        c->nulls[row / 8] |= (uint8_t)(1 << (row % 8));
+        return (c->types & text) ? js_column_fill(ctx, c, row + 1) : true;
+    }
+    
+    if (!c->numbers) {
+        c->numbers = (uint8_t *)sqlite3_malloc64(capacity * 8);
+        if (!c->numbers) return false;
+        memset(c->numbers, 0, capacity * 8);
+    }
+    
+    if (type == SQLITE_FLOAT && !c->as_real) {
+        // first REAL value, integers collected so far are converted in place
+        for (sqlite3_uint64 i=0; i<row; ++i) {
+            int64_t n;
+            memcpy(&n, c->numbers + i * 8, 8);
+            double d = (double)n;
+            memcpy(c->numbers + i * 8, &d, 8);
+        }
+        c->as_real = true;
+    }
+    
+    if (c->as_real) {
+        double d = sqlite3_value_double(value);
+        memcpy(c->numbers + row * 8, &d, 8);
+    } else {
+        int64_t n = (int64_t)sqlite3_value_int64(value);
+        if (n > JSCOLUMN_MAX_EXACT_INTEGER || n < -JSCOLUMN_MAX_EXACT_INTEGER) c->exact = false;
+        memcpy(c->numbers + row * 8, &n, 8);
+    }
+    return (c->types & text) ? js_column_fill(ctx, c, row + 1) : true;
+}
+
+static JSValue js_column_finalize (JSContext *ctx, jscolumn *c, const char *name, sqlite3_uint64 nrows) {
+    int numeric = (1 << SQLITE_INTEGER) | (1 << SQLITE_FLOAT);
+    int types = c->types & ~(1 << SQLITE_NULL);
+    
+    const char *type_name = "null";
+    if (types == (1 << SQLITE_INTEGER)) type_name = "integer";
+    else if (types && (types & ~numeric) == 0) type_name = "real";
+    else if (types == (1 << SQLITE_TEXT)) type_name = "text";
+    else if (types == (1 << SQLITE_BLOB)) type_name = "blob";
+    else if (types) type_name = "mixed";
+    
+    JSValue values = JS_UNDEFINED;
+    if (types && (types & ~numeric) == 0) {
+        // numeric column, buffer is moved to a typed array without copies
+        JSTypedArrayEnum array_type = JS_TYPED_ARRAY_FLOAT64;
+        if (!c->as_real) {
+            if (c->exact) {
+                for (sqlite3_uint64 i=0; i<nrows; ++i) {
+                    int64_t n;
+                    memcpy(&n, c->numbers + i * 8, 8);
+                    double d = (double)n;
+                    memcpy(c->numbers + i * 8, &d, 8);
+                }
+            } else {
+                array_type = JS_TYPED_ARRAY_BIG_INT64;
+            }
+        }
+        
+        JSValue buffer = JS_NewArrayBuffer(ctx, c->numbers, nrows * 8, js_column_free_buffer, NULL, false);
+        if (JS_IsException(buffer)) return JS_EXCEPTION;
+        c->numbers = NULL;
+        // typed array constructor always reads offset and length arguments
+        JSValue args[3] = {buffer, JS_NewInt32(ctx, 0), JS_UNDEFINED};
+        values = JS_NewTypedArray(ctx, 3, args, array_type);
+        JS_FreeValue(ctx, buffer);
+    } else {
+        if (!js_column_fill(ctx, c, nrows)) return JS_EXCEPTION;
+        values = JS_DupValue(ctx, c->values);
+    }
+    if (JS_IsException(values)) return JS_EXCEPTION;
+    
+    JSValue nulls = JS_NewUint8Array(ctx, c->nulls, (nrows + 7) / 8, js_column_free_buffer, NULL, false);
+    if (JS_IsException(nulls)) {
+        JS_FreeValue(ctx, values);
+        return JS_EXCEPTION;
+    }
+    c->nulls = NULL;
+    
+    JSValue column = JS_NewObject(ctx);
+    if (JS_IsException(column)) {
+        JS_FreeValue(ctx, values);
+        JS_FreeValue(ctx, nulls);
+        return JS_EXCEPTION;
+    }
+    JS_SetPropertyStr(ctx, column, "name", JS_NewString(ctx, name));
+    JS_SetPropertyStr(ctx, column, "type", JS_NewString(ctx, type_name));
+    JS_SetPropertyStr(ctx, column, "values", values);
+    JS_SetPropertyStr(ctx, column, "nulls", nulls);
+    return column;
+}
+
+static JSValue js_rowset_to_columns(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    (void)argc; (void)argv;
+    globaljs_context *js = JS_GetContextOpaque(ctx);
+    rowset *rs = JS_GetOpaque(this_val, js->rowSetClassID);
+    if (!rs) return JS_EXCEPTION;
+    if (!rs->vm) return JS_NewArray(ctx);
+    
+    int ncols = rs->ncols;
+    sqlite3_uint64 nrows = 0;
+    sqlite3_uint64 capacity = 0;
+    JSValue result = JS_EXCEPTION;
+    
+    jscolumn *columns = (jscolumn *)sqlite3_malloc64(sizeof(jscolumn) * (ncols + 1));
+    if (!columns) return JS_ThrowOutOfMemory(ctx);
+    for (int i=0; i<ncols; ++i) {
+        columns[i] = (jscolumn){.types = 0, .as_real = false, .exact = true, .numbers = NULL, .nulls = NULL, .values = JS_NewArray(ctx), .nvalues = 0};
+    }
+    for (int i=0; i<ncols; ++i) {
+        if (JS_IsException(columns[i].values)) goto abort_columns;
+    }
+    if (!js_columns_grow(columns, ncols, 0, 1024)) goto abort_columns;
+    capacity = 1024;
+    
+    int rc;
+    while ((rc = js_step(ctx, rs->vm)) == SQLITE_ROW) {
+        if (nrows == capacity) {
+            if (!js_columns_grow(columns, ncols, capacity, capacity * 2)) goto abort_columns;
+            capacity *= 2;
+        }
+        for (int i=0; i<ncols; ++i) {
+            if (!js_column_append(ctx, &columns[i], sqlite3_column_value(rs->vm, i), nrows, capacity)) goto abort_columns;
+        }
+        ++nrows;
+    }
+    if (rc != SQLITE_DONE) {
+        js_rowset_dberror(ctx, js, rs, rc);
+        goto abort_columns;
+    }
+    
+    result = JS_NewArray(ctx);
+    if (JS_IsException(result)) goto abort_columns;
+    for (int i=0; i<ncols; ++i) {
+        const char *name = sqlite3_column_name(rs->vm, i);
+        JSValue column = js_column_finalize(ctx, &columns[i], (name) ? name : "", nrows);
+        if (JS_IsException(column)) {
+            JS_FreeValue(ctx, result);
+            result = JS_EXCEPTION;
+            goto abort_columns;
+        }
+        JS_SetPropertyUint32(ctx, result, (uint32_t)i, column);
+    }
+    
+abort_columns:
+    if (JS_IsException(result) && !JS_HasException(ctx)) JS_ThrowOutOfMemory(ctx);
+    for (int i=0; i<ncols; ++i) {
+        if (columns[i].numbers) sqlite3_free(columns[i].numbers);
+        if (columns[i].nulls) sqlite3_free(columns[i].nulls);
+        JS_FreeValue(ctx, columns[i].values);
+    }
+    sqlite3_free(columns);
+    
+    jsstmt_release(&js->stmt_cache, rs->vm);
+    rs->vm = NULL;
+    return result;
+}
+
+static void js_rowset_finalizer(JSRuntime *rt, JSValue val) {
+    globaljs_context *js = JS_GetRuntimeOpaque(rt);
+    rowset *rs = (rowset *)JS_GetOpaque(val, js->rowSetClassID);
+    if (!rs) return;
+    
+    if (rs->vm) jsstmt_release(&js->stmt_cache, rs->vm);
+    if (rs->atoms) {
+        for (int i=0; i<rs->ncols; ++i) JS_FreeAtomRT(rt, rs->atoms[i]);
+        sqlite3_free(rs->atoms);
+    }
+    sqlite3_free(rs);
+}
+
+static JSValue js_rowset_rows(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    globaljs_context *js = JS_GetContextOpaque(ctx);
+    rowset *rs = JS_GetOpaque(this_val, js->rowSetClassID);
+    if (!rs) return JS_ThrowTypeError(ctx, "Rowset expected");
+    
+    // rows({objects: true, reuse: true}), with reuse the same row is updated in place at every step
+    bool objects = false, reuse = false;
+    if (argc > 0 && JS_IsObject(argv[0])) {
+        JSValue value = JS_GetPropertyStr(ctx, argv[0], "objects");
+        objects = JS_ToBool(ctx, value);
+        JS_FreeValue(ctx, value);
+        value = JS_GetPropertyStr(ctx, argv[0], "reuse");
+        reuse = JS_ToBool(ctx, value);
+        JS_FreeValue(ctx, value);
+    }
+    if (objects && rs->vm && !js_rowset_atoms(ctx, rs)) return JS_ThrowOutOfMemory(ctx);
+    
+    rowiterator *it = (rowiterator *)sqlite3_malloc(sizeof(rowiterator));
+    if (!it) return JS_ThrowOutOfMemory(ctx);
+    
+    JSValue obj = JS_NewObjectClass(ctx, js->rowIteratorClassID);
+    if (JS_IsException(obj)) {
+        sqlite3_free(it);
+        return JS_EXCEPTION;
+    }
+    
+    it->rowset = JS_DupValue(ctx, this_val);
+    it->row = JS_UNDEFINED;
+    it->reuse = reuse;
+    it->objects = objects;
+    JS_SetOpaque(obj, it);
+    return obj;
+}
+
+static JSValue js_rowiterator_fill (JSContext *ctx, rowiterator *it, rowset *rs) {
+    if (!it->reuse) {
+        return (it->objects) ? js_row_to_object(ctx, rs->vm, rs->ncols, rs->atoms) : js_row_to_array(ctx, rs->vm, rs->ncols);
+    }
+    
+    if (JS_IsUndefined(it->row)) {
+        it->row = (it->objects) ? js_row_to_object(ctx, rs->vm, rs->ncols, rs->atoms) : js_row_to_array(ctx, rs->vm, rs->ncols);
+        if (JS_IsException(it->row)) {
+            it->row = JS_UNDEFINED;
+            return JS_EXCEPTION;
+        }
+        return JS_DupValue(ctx, it->row);
+    }
+    
+    // the row already has all the properties (in the same order), values are just replaced
+    for (int i=0; i<rs->ncols; ++i) {
+        JSValue value = sqlite_value_to_js(ctx, sqlite3_column_value(rs->vm, i));
+        int rc = (it->objects) ? JS_SetProperty(ctx, it->row, rs->atoms[i], value) : JS_SetPropertyUint32(ctx, it->row, (uint32_t)i, value);
+        if (rc < 0) return JS_EXCEPTION;
+    }
+    return JS_DupValue(ctx, it->row);
+}
+
+static void js_rowiterator_done (JSContext *ctx, globaljs_context *js, rowiterator *it, rowset *rs) {
+    if (rs && rs->vm) {
+        jsstmt_release(&js->stmt_cache, rs->vm);
+        rs->vm = NULL;
+    }
+    JS_FreeValue(ctx, it->row);
+    it->row = JS_UNDEFINED;
+}
+
+static JSValue js_rowiterator_next(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv, int *pdone, int magic) {
+    (void)argc; (void)argv; (void)magic;
+    globaljs_context *js = JS_GetContextOpaque(ctx);
+    rowiterator *it = JS_GetOpaque(this_val, js->rowIteratorClassID);
+    if (!it) return JS_ThrowTypeError(ctx, "RowIterator expected");
+    
+    rowset *rs = JS_GetOpaque(it->rowset, js->rowSetClassID);
+    int rc = (rs && rs->vm) ? js_step(ctx, rs->vm) : SQLITE_DONE;
+    if (rc != SQLITE_ROW) {
+        JSValue result = (rc == SQLITE_DONE) ? JS_UNDEFINED : js_rowset_dberror(ctx, js, rs, rc);
+        js_rowiterator_done(ctx, js, it, rs);
+        *pdone = true;
+        return result;
+    }
+    
+    *pdone = false;
+    return js_rowiterator_fill(ctx, it, rs);
+}
+
+static JSValue js_rowiterator_return(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    // called when a for..of loop exits early, the statement is released without stepping the remaining rows
+    (void)argc; (void)argv;
+    globaljs_context *js = JS_GetContextOpaque(ctx);
+    rowiterator *it = JS_GetOpaque(this_val, js->rowIteratorClassID);
+    if (!it) return JS_ThrowTypeError(ctx, "RowIterator expected");
+    
+    js_rowiterator_done(ctx, js, it, JS_GetOpaque(it->rowset, js->rowSetClassID));
+    
+    JSValue result = JS_NewObject(ctx);
+    if (JS_IsException(result)) return JS_EXCEPTION;
+    JS_SetPropertyStr(ctx, result, "value", JS_UNDEFINED);
+    JS_SetPropertyStr(ctx, result, "done", JS_TRUE);
+    return result;
+}
+
+static JSValue js_rowiterator_iterator(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    (void)argc; (void)argv;
+    return JS_DupValue(ctx, this_val);
+}
+
+static void js_rowiterator_mark(JSRuntime *rt, JSValueConst val, JS_MarkFunc *mark_func) {
+    globaljs_context *js = JS_GetRuntimeOpaque(rt);
+    rowiterator *it = (rowiterator *)JS_GetOpaque(val, js->rowIteratorClassID);
+    if (!it) return;
+    
+    JS_MarkValue(rt, it->rowset, mark_func);
+    JS_MarkValue(rt, it->row, mark_func);
+}
+
+static void js_rowiterator_finalizer(JSRuntime *rt, JSValue val) {
+    globaljs_context *js = JS_GetRuntimeOpaque(rt);
+    rowiterator *it = (rowiterator *)JS_GetOpaque(val, js->rowIteratorClassID);
+    if (!it) return;
+    
+    JS_FreeValueRT(rt, it->rowset);
+    JS_FreeValueRT(rt, it->row);
+    sqlite3_free(it);
+}
+
+// MARK: - Statement -
+
+struct jsstatement {
+    struct jsstatement  *prev;      // list of statements in globaljs_context
+    struct jsstatement  *next;
+    int                 ncols;
+    sqlite3_stmt        *vm;        // to release, NULL if finalized or released by js_release
+    char                *sql;       // to release, used to prepare the statement again after js_release (NULL once finalized)
+};
+
+static void js_statement_finalizer(JSRuntime *rt, JSValue val);
+static JSValue js_statement_bind(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv);
+static JSValue js_statement_step(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv);
+static JSValue js_statement_get(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv);
+static JSValue js_statement_name(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv);
+static JSValue js_statement_reset(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv);
+static JSValue js_statement_run(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv);
+static JSValue js_statement_all(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv);
+static JSValue js_statement_finalize(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv);
+
+// Define the Statement class
+static const JSClassDef js_statement_class = {
+    "Statement",
+    .finalizer = js_statement_finalizer,
+};
+
+// Define the Statement prototype with methods
+static const JSCFunctionListEntry js_statement_proto_funcs[] = {
+    JS_CFUNC_DEF("bind", 0, js_statement_bind),
+    JS_CFUNC_DEF("step", 0, js_statement_step),
+    JS_CFUNC_DEF("get", 1, js_statement_get),
+    JS_CFUNC_DEF("name", 1, js_statement_name),
+    JS_CFUNC_DEF("reset", 0, js_statement_reset),
+    JS_CFUNC_DEF("run", 0, js_statement_run),
+    JS_CFUNC_DEF("all", 0, js_statement_all),
+    JS_CFUNC_DEF("finalize", 0, js_statement_finalize),
+};
+
+static jsstatement *js_statement_opaque (JSContext *ctx, JSValueConst this_val) {
+    globaljs_context *js = JS_GetContextOpaque(ctx);
+    jsstatement *stmt = JS_GetOpaque(this_val, js->statementClassID);
+    if (!stmt) {
+        JS_ThrowTypeError(ctx, "Not a Statement object");
+        return NULL;
+    }
+    if (!stmt->sql) {
+        JS_ThrowTypeError(ctx, "Statement has been finalized");
+        return NULL;
+    }
+    
+    // statement released by js_release, bindings are lost
+    if (!stmt->vm && sqlite3_prepare_v3(js->db, stmt->sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt->vm, NULL) != SQLITE_OK) {
+        JS_ThrowInternalError(ctx, "%s", sqlite3_errmsg(js->db));
+        sqlite3_finalize(stmt->vm);
+        stmt->vm = NULL;
+        return NULL;
+    }
+    return stmt;
+}
+
+static JSValue js_statement_dberror (JSContext *ctx, sqlite3_stmt *vm) {
+    return JS_ThrowInternalError(ctx, "%s", sqlite3_errmsg(sqlite3_db_handle(vm)));
+}
+
+static bool js_statement_rebind (JSContext *ctx, sqlite3_stmt *vm, int argc, JSValueConst *argv) {
+    // new values replace all the previous bindings
+    sqlite3_reset(vm);
+    sqlite3_clear_bindings(vm);
+    
+    int rc = js_bind_values(ctx, vm, argc, argv);
+    if (rc == -1) return false;
+    if (rc != SQLITE_OK) {
+        js_statement_dberror(ctx, vm);
+        return false;
+    }
+    return true;
+}
+
+static JSValue js_statement_bind(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    jsstatement *stmt = js_statement_opaque(ctx, this_val);
+    if (!stmt) return JS_EXCEPTION;
+    
+    if (!js_statement_rebind(ctx, stmt->vm, argc, argv)) return JS_EXCEPTION;
+    return JS_DupValue(ctx, this_val);
+}
+
+static JSValue js_statement_step(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    (void)argc; (void)argv;
+    jsstatement *stmt = js_statement_opaque(ctx, this_val);
+    if (!stmt) return JS_EXCEPTION;
+    
+    int rc = js_step(ctx, stmt->vm);
+    if (rc == SQLITE_ROW) return JS_TRUE;
+    if (rc == SQLITE_DONE) return JS_FALSE;
+    return (rc == -1) ? JS_EXCEPTION : js_statement_dberror(ctx, stmt->vm);
+}
+
+static JSValue js_statement_get(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    jsstatement *stmt = js_statement_opaque(ctx, this_val);
+    if (!stmt) return JS_EXCEPTION;
+    
+    uint32_t index = 0;
+    if (argc < 1 || JS_ToUint32(ctx, &index, argv[0]) < 0) return JS_EXCEPTION;
+    if (index >= (uint32_t)stmt->ncols) return JS_ThrowRangeError(ctx, "Column index out of range");
+    
+    sqlite3_value *value = sqlite3_column_value(stmt->vm, (int)index);
+    return sqlite_value_to_js(ctx, value);
+}
+
+static JSValue js_statement_name(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    jsstatement *stmt = js_statement_opaque(ctx, this_val);
+    if (!stmt) return JS_EXCEPTION;
+    
+    uint32_t index = 0;
+    if (argc < 1 || JS_ToUint32(ctx, &index, argv[0]) < 0) return JS_EXCEPTION;
+    if (index >= (uint32_t)stmt->ncols) return JS_ThrowRangeError(ctx, "Column index out of range");
+    
+    const char *name = sqlite3_column_name(stmt->vm, (int)index);
+    if (!name) return JS_ThrowOutOfMemory(ctx);
+    
+    return JS_NewString(ctx, name);
+}
+
+static JSValue js_statement_reset(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    (void)argc; (void)argv;
+    jsstatement *stmt = js_statement_opaque(ctx, this_val);
+    if (!stmt) return JS_EXCEPTION;
+    
+    // bindings are preserved, as in sqlite3_reset
+    sqlite3_reset(stmt->vm);
+    return JS_DupValue(ctx, this_val);
+}
+
+static JSValue js_statement_run(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    jsstatement *stmt = js_statement_opaque(ctx, this_val);
+    if (!stmt) return JS_EXCEPTION;
+    
+    // optional arguments replace the current bindings
+    if (argc > 0 && !js_statement_rebind(ctx, stmt->vm, argc, argv)) return JS_EXCEPTION;
+    else if (argc == 0) sqlite3_reset(stmt->vm);
+    
+    // execute until completion and leave the statement ready to be executed again
+    int rc;
+    while ((rc = js_step(ctx, stmt->vm)) == SQLITE_ROW);
+    JSValue result = JS_EXCEPTION;
+    if (rc == SQLITE_DONE) result = JS_NewInt64(ctx, sqlite3_changes64(sqlite3_db_handle(stmt->vm)));
+    else if (rc != -1) result = js_statement_dberror(ctx, stmt->vm);
+    sqlite3_reset(stmt->vm);
+    
+    return result;
+}
+
+static JSValue js_statement_all(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    jsstatement *stmt = js_statement_opaque(ctx, this_val);
+    if (!stmt) return JS_EXCEPTION;
+    
+    // optional arguments replace the current bindings
+    if (argc > 0 && !js_statement_rebind(ctx, stmt->vm, argc, argv)) return JS_EXCEPTION;
+    else if (argc == 0) sqlite3_reset(stmt->vm);
+    
+    JSValue result = JS_NewArray(ctx);
+    if (JS_IsException(result)) return JS_EXCEPTION;
+    
+    int rc;
+    uint32_t nrows = 0;
+    while ((rc = js_step(ctx, stmt->vm)) == SQLITE_ROW) {
+        JSValue row = js_row_to_array(ctx, stmt->vm, stmt->ncols);
+        if (JS_IsException(row)) {
+            JS_FreeValue(ctx, result);
+            sqlite3_reset(stmt->vm);
+            return JS_EXCEPTION;
+        }
+        JS_SetPropertyUint32(ctx, result, nrows++, row);
+    }
+    
+    if (rc != SQLITE_DONE) {
+        JS_FreeValue(ctx, result);
+        result = (rc == -1) ? JS_EXCEPTION : js_statement_dberror(ctx, stmt->vm);
+    }
+    sqlite3_reset(stmt->vm);
+    
+    return result;
+}
+
+static JSValue js_statement_finalize(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    (void)argc; (void)argv;
+    globaljs_context *js = JS_GetContextOpaque(ctx);
+    jsstatement *stmt = JS_GetOpaque(this_val, js->statementClassID);
+    if (!stmt) return JS_ThrowTypeError(ctx, "Not a Statement object");
+    
+    if (stmt->vm) sqlite3_finalize(stmt->vm);
+    if (stmt->sql) sqlite3_free(stmt->sql);
+    stmt->vm = NULL;
+    stmt->sql = NULL;
+    return JS_UNDEFINED;
+}
+
+static void js_statement_finalizer(JSRuntime *rt, JSValue val) {
+    globaljs_context *js = JS_GetRuntimeOpaque(rt);
+    jsstatement *stmt = (jsstatement *)JS_GetOpaque(val, js->statementClassID);
+    if (!stmt) return;
+    
+    if (stmt->prev) stmt->prev->next = stmt->next; else js->statements = stmt->next;
+    if (stmt->next) stmt->next->prev = stmt->prev;
+    
+    if (stmt->vm) sqlite3_finalize(stmt->vm);
+    if (stmt->sql) sqlite3_free(stmt->sql);
+    sqlite3_free(stmt);
+}
+
+static int js_release_statements (globaljs_context *js) {
+    // finalize all the statements owned by JavaScript objects so the connection can be closed,
+    // Statement objects prepare their statement again the next time they are used
+    int count = js->stmt_cache.count;
+    jsstmt_cache_trim(&js->stmt_cache, 0);
+    
+    for (jsstatement *stmt = js->statements; stmt; stmt = stmt->next) {
+        if (!stmt->vm) continue;
+        sqlite3_finalize(stmt->vm);
+        stmt->vm = NULL;
+        ++count;
+    }
+    return count;
+}
+
+// MARK: - Close Hook -
+
+// sqlite3_close() returns SQLITE_BUSY while any statement is alive, and the function destructors that
+// free globaljs_context run only after that check. Virtual tables are disconnected before it, so the
+// eponymous-only table sqlite_js_close_hook is connected as soon as JS creates a statement and its xDisconnect
+// finalizes the cached and prepared statements. The sqlite_ prefix is reserved, so the name cannot clash with
+// a user table, and the table cannot be queried (xBestIndex rejects every plan).
+
+#define JS_CLOSE_HOOK_NAME              "sqlite_js_close_hook"
+
+typedef struct {
+    sqlite3_vtab        base;
+    globaljs_context    *js;
+} jsclosehook_vtab;
+
+static int js_close_hook_connect (sqlite3 *db, void *aux, int argc, const char *const *argv, sqlite3_vtab **vtab, char **err_msg) {
+    (void)argc; (void)argv; (void)err_msg;
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(unused)");
+    if (rc != SQLITE_OK) return rc;
+    sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+    
+    jsclosehook_vtab *table = (jsclosehook_vtab *)sqlite3_malloc(sizeof(jsclosehook_vtab));
+    if (!table) return SQLITE_NOMEM;
+    memset(table, 0, sizeof(jsclosehook_vtab));
+    table->js = (globaljs_context *)aux;
+    table->js->close_hook = true;
+    
+    *vtab = &table->base;
+    return SQLITE_OK;
+}
+
+static int js_close_hook_disconnect (sqlite3_vtab *vtab) {
+    // called by sqlite3_close (even when it then fails because of other statements), the hook is
+    // connected again the next time JS creates a statement
+    jsclosehook_vtab *table = (jsclosehook_vtab *)vtab;
+    table->js->close_hook = false;
+    js_release_statements(table->js);
+    sqlite3_free(table);
+    return SQLITE_OK;
+}
+
+static int js_close_hook_best_index (sqlite3_vtab *vtab, sqlite3_index_info *info) {
+    // the table exists only for its xDisconnect, every query that reads it fails to find a plan
+    (void)vtab; (void)info;
+    return SQLITE_CONSTRAINT;
+}
+
+static int js_close_hook_open (sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor) {
+    (void)vtab;
+    sqlite3_vtab_cursor *c = (sqlite3_vtab_cursor *)sqlite3_malloc(sizeof(sqlite3_vtab_cursor));
+    if (!c) return SQLITE_NOMEM;
+    memset(c, 0, sizeof(sqlite3_vtab_cursor));
+    *cursor = c;
+    return SQLITE_OK;
+}
+
+static int js_close_hook_close (sqlite3_vtab_cursor *cursor) {
+    sqlite3_free(cursor);
+    return SQLITE_OK;
+}
+
+static int js_close_hook_filter (sqlite3_vtab_cursor *cursor, int idx_num, const char *idx_str, int argc, sqlite3_value **argv) {
+    (void)cursor; (void)idx_num; (void)idx_str; (void)argc; (void)argv;
+    return SQLITE_OK;
+}
+
+static int js_close_hook_next (sqlite3_vtab_cursor *cursor) {
+    (void)cursor;
+    return SQLITE_OK;
+}
+
+static int js_close_hook_eof (sqlite3_vtab_cursor *cursor) {
+    (void)cursor;
+    return 1;
+}
+
+static int js_close_hook_column (sqlite3_vtab_cursor *cursor, sqlite3_context *context, int index) {
+    (void)cursor; (void)index;
+    sqlite3_result_null(context);
+    return SQLITE_OK;
+}
+
+static int js_close_hook_rowid (sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+    (void)cursor;
+    *rowid = 0;
+    return SQLITE_OK;
+}
+
+static sqlite3_module js_close_hook_module = {
+    .iVersion = 0,
+    .xCreate = NULL,            // eponymous-only table
+    .xConnect = js_close_hook_connect,
+    .xBestIndex = js_close_hook_best_index,
+    .xDisconnect = js_close_hook_disconnect,
+    .xOpen = js_close_hook_open,
+    .xClose = js_close_hook_close,
+    .xFilter = js_close_hook_filter,
+    .xNext = js_close_hook_next,
+    .xEof = js_close_hook_eof,
+    .xColumn = js_close_hook_column,
+    .xRowid = js_close_hook_rowid,
+};
+
+static void js_close_hook_install (globaljs_context *js) {
+    // preparing a statement that names the table connects it (the prepare itself then fails because no plan is
+    // accepted), the table stays connected until the connection is closed; if it cannot be connected (for example
+    // an authorizer denies it) this is not retried and js_release is the only way to finalize the statements
+    if (js->close_hook) return;
+    js->close_hook = true;
+    
+    sqlite3_stmt *vm = NULL;
+    sqlite3_prepare_v2(js->db, "SELECT 1 FROM " JS_CLOSE_HOOK_NAME, -1, &vm, NULL);
+    sqlite3_finalize(vm);
+}
+
+// MARK: - Initializer -
+
+static globaljs_context *globaljs_init (sqlite3 *db) {
+    JSRuntime *rt = NULL;
+    JSContext *ctx = NULL;
+    
+    globaljs_context *js = (globaljs_context *)sqlite3_malloc(sizeof(globaljs_context));
+    if (!js) return NULL;
+    memset(js, 0, sizeof(globaljs_context));
+    
+    rt = JS_NewRuntime();
+    if (!rt) goto abort_init;
+    
+    //JS_SetMemoryLimit(rt, 80 * 1024);
+    //JS_SetMaxStackSize(rt, 10 * 1024);
+    
+    js_std_init_handlers(rt);
+    JS_SetModuleLoaderFunc(rt, NULL, js_module_loader, NULL);
+    
+    ctx = JS_NewContext(rt);
+    if (!ctx) goto abort_init;
+    
+    js->db = db;
+    js->runtime = rt;
+    js->context = ctx;
+    js->ref_count = 0;
+    
+    JS_SetContextOpaque(ctx, js);
+    JS_SetRuntimeOpaque(rt, js);
+    js_global_init(ctx, js);
+    
+    return js;
+    
+abort_init:
+    if (rt) JS_FreeRuntime(rt);
+    if (ctx) JS_FreeContext(ctx);
+    if (js) sqlite3_free(js);
+    return NULL;
+}
+
+static void globaljs_free (globaljs_context *js) {
+    if (!js) return;
+
+    // order matters
+    // (statements still used by live Rowsets are finalized by the Rowset finalizer once the cache is disabled,
+    // Statement objects are only unlinked by their finalizer once their statement has been finalized here)
+    js_release_statements(js);
+    js->stmt_cache.capacity = 0;
+    for (uint32_t i=0; i<js->nglobal_atoms; ++i) JS_FreeAtomRT(js->runtime, js->global_atoms[i]);
+    if (js->global_atoms) sqlite3_free(js->global_atoms);
+    if (js->runtime) js_std_free_handlers(js->runtime);
+    if (js->context) JS_FreeContext(js->context);
+    if (js->runtime) JS_FreeRuntime(js->runtime);
     sqlite3_free(js);
 }
 
@@ -228,9 +1747,10 @@ void globaljs_dec_and_free_if_needed (void *ptr) {
     if (js->ref_count == 0) globaljs_free(js);
 }
 
-static functionjs_context *functionjs_init (globaljs_context *jsctx, const char *init_code, const char *step_code, const char *final_code, const char *value_code, const char *inverse_code) {
+static functionjs_context *functionjs_init (globaljs_context *jsctx, const char *kind, const char *name, const char *init_code, const char *step_code, const char *final_code, const char *value_code, const char *inverse_code, int nargs, const functionjs_options *options) {
     // make a copy of all the code
     functionjs_context *fctx = NULL;
+    char *name_copy = NULL;
     char *init_code_copy = NULL;
     char *step_code_copy = NULL;
     char *final_code_copy = NULL;
@@ -241,6 +1761,14 @@ static functionjs_context *functionjs_init (globaljs_context *jsctx, const char
     if (!fctx) goto cleanup;
     memset(fctx, 0, sizeof(functionjs_context));
     
+    name_copy = sqlite_strdup(name);
+    if (!name_copy) goto cleanup;
+    
+    if (options->cache_size > 0) {
+        fctx->cache = jscache_create(options->cache_size);
+        if (!fctx->cache) goto cleanup;
+    }
+    
     if (init_code) {
         init_code_copy = sqlite_strdup(init_code);
         if (!init_code_copy) goto cleanup;
@@ -269,17 +1797,32 @@ static functionjs_context *functionjs_init (globaljs_context *jsctx, const char
     fctx->js_ctx = jsctx;
     jsctx->ref_count++;  // Increment reference count
     
+    // keep track of the function so it can be inspected by name
+    fctx->next = jsctx->functions;
+    jsctx->functions = fctx;
+    
+    fctx->kind = kind;
+    fctx->name = name_copy;
     fctx->init_code = init_code_copy;
     fctx->step_code = step_code_copy;
     fctx->final_code = final_code_copy;
     fctx->value_code = value_code_copy;
     fctx->inverse_code = inverse_code_copy;
     
+    fctx->nargs = nargs;
+    fctx->options = *options;
     fctx->func = JS_NULL;
+    fctx->init_func = JS_NULL;
+    fctx->step_func = JS_NULL;
+    fctx->final_func = JS_NULL;
+    fctx->value_func = JS_NULL;
+    fctx->inverse_func = JS_NULL;
 
     return fctx;
     
 cleanup:
+    if (name_copy) sqlite3_free(name_copy);
+    if (fctx && fctx->cache) jscache_free(fctx->cache);
     if (init_code_copy) sqlite3_free(init_code_copy);
     if (step_code_copy) sqlite3_free(step_code_copy);
     if (final_code_copy) sqlite3_free(final_code_copy);
@@ -289,17 +1832,51 @@ cleanup:
     return NULL;
 }
 
-static void functionjs_aggregate_free (functionjs_aggregate_context *agg_ctx) {
-    if (!agg_ctx) return;
+static void jspool_entry_free (jspool_entry *entry) {
+    JS_FreeContext(entry->context);
+    sqlite3_free(entry);
+}
+
+static bool functionjs_pool_release (functionjs_context *fctx, functionjs_aggregate_context *agg_ctx) {
+    // try to return an isolated context to the pool instead of destroying it
+    if (!fctx || !agg_ctx->owns_context || fctx->pool_count >= fctx->options.pool_size) return false;
     
-    JSContext *context = agg_ctx->context;
+    jspool_entry *entry = (jspool_entry *)sqlite3_malloc(sizeof(jspool_entry));
+    if (!entry) return false;
     
-    // always to release
+    // the functions are not kept because their closures hold the state of the group, they are evaluated
+    // again (after the init code) when the context is reused, globals created by the group are removed
+    JSContext *context = agg_ctx->context;
     if (!JS_IsNull(agg_ctx->step_func)) JS_FreeValue(context, agg_ctx->step_func);
     if (!JS_IsNull(agg_ctx->final_func)) JS_FreeValue(context, agg_ctx->final_func);
     if (!JS_IsNull(agg_ctx->value_func)) JS_FreeValue(context, agg_ctx->value_func);
     if (!JS_IsNull(agg_ctx->inverse_func)) JS_FreeValue(context, agg_ctx->inverse_func);
-    JS_FreeContext(context);
+    js_global_reset(context, fctx->js_ctx);
+    
+    entry->context = context;
+    entry->next = fctx->pool;
+    fctx->pool = entry;
+    fctx->pool_count++;
+    
+    return true;
+}
+
+static void functionjs_aggregate_free (functionjs_context *fctx, functionjs_aggregate_context *agg_ctx) {
+    if (!agg_ctx) return;
+    
+    JSContext *context = agg_ctx->context;
+    
+    // always to release
+    if (!JS_IsNull(agg_ctx->state)) JS_FreeValue(context, agg_ctx->state);
+    agg_ctx->state = JS_NULL;
+    
+    if (functionjs_pool_release(fctx, agg_ctx) == false) {
+        if (!JS_IsNull(agg_ctx->step_func)) JS_FreeValue(context, agg_ctx->step_func);
+        if (!JS_IsNull(agg_ctx->final_func)) JS_FreeValue(context, agg_ctx->final_func);
+        if (!JS_IsNull(agg_ctx->value_func)) JS_FreeValue(context, agg_ctx->value_func);
+        if (!JS_IsNull(agg_ctx->inverse_func)) JS_FreeValue(context, agg_ctx->inverse_func);
+        if (agg_ctx->owns_context) JS_FreeContext(context);
+    }
     
     agg_ctx->step_func = JS_NULL;
     agg_ctx->final_func = JS_NULL;
@@ -308,12 +1885,47 @@ static void functionjs_aggregate_free (functionjs_aggregate_context *agg_ctx) {
     agg_ctx->context = NULL;
 }
 
+static void functionjs_bytecode_free (functionjs_context *fctx) {
+    for (int i=0; i<FUNCTION_CODE_COUNT; ++i) {
+        if (fctx->bytecode[i]) js_free(fctx->js_ctx->context, fctx->bytecode[i]);
+        fctx->bytecode[i] = NULL;
+        fctx->bytecode_size[i] = 0;
+    }
+}
+
+static void functionjs_compiled_free (functionjs_context *fctx) {
+    // release everything produced by the compilation of the code
+    JSContext *ctx = fctx->js_ctx->context;
+    JSValue *func[] = {&fctx->func, &fctx->init_func, &fctx->step_func, &fctx->final_func, &fctx->value_func, &fctx->inverse_func};
+    
+    for (size_t i=0; i<sizeof(func) / sizeof(JSValue *); ++i) {
+        if (!JS_IsNull(*func[i])) JS_FreeValue(ctx, *func[i]);
+        *func[i] = JS_NULL;
+    }
+    functionjs_bytecode_free(fctx);
+}
+
 static void functionjs_free (functionjs_context *fctx) {
     if (!fctx) return;
     globaljs_context *js = fctx->js_ctx;
     
-    if (!JS_IsNull(fctx->func)) JS_FreeValue(js->context, fctx->func);
+    functionjs_compiled_free(fctx);
+    if (fctx->lazy_bytecode) sqlite3_free(fctx->lazy_bytecode);
+    
+    while (fctx->pool) {
+        jspool_entry *entry = fctx->pool;
+        fctx->pool = entry->next;
+        jspool_entry_free(entry);
+    }
+    
+    // remove function from the list of registered functions
+    functionjs_context **p = &js->functions;
+    while (*p && *p != fctx) p = &(*p)->next;
+    if (*p) *p = fctx->next;
     
+    if (fctx->cache) jscache_free(fctx->cache);
+    if (fctx->last_error) sqlite3_free(fctx->last_error);
+    if (fctx->name) sqlite3_free((void *)fctx->name);
     if (fctx->init_code) sqlite3_free((void *)fctx->init_code);
     if (fctx->step_code) sqlite3_free((void *)fctx->step_code);
     if (fctx->final_code) sqlite3_free((void *)fctx->final_code);
@@ -324,36 +1936,708 @@ static void functionjs_free (functionjs_context *fctx) {
     globaljs_dec_and_free_if_needed(js);
 }
 
+// MARK: - Dates -
+
+static int64_t js_days_from_civil (int64_t y, int m, int d) {
+    // number of days since 1970-01-01 of a proleptic Gregorian date
+    y -= (m <= 2);
+    int64_t era = ((y >= 0) ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m + ((m > 2) ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+static void js_civil_from_days (int64_t z, int *y, int *m, int *d) {
+    z += 719468;
+    int64_t era = ((z >= 0) ? z : z - 146096) / 146097;
+    int64_t doe = z - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+    *d = (int)(doy - (153 * mp + 2) / 5 + 1);
+    *m = (int)((mp < 10) ? mp + 3 : mp - 9);
+    *y = (int)(yoe + era * 400 + (*m <= 2));
+}
+
+static int js_parse_digits (const char *s, int n) {
+    int value = 0;
+    for (int i=0; i<n; ++i) {
+        if (s[i] < '0' || s[i] > '9') return -1;
+        value = value * 10 + (s[i] - '0');
+    }
+    return value;
+}
+
+static bool js_parse_iso8601 (const char *s, int len, double *epoch_ms) {
+    // YYYY-MM-DD optionally followed by [T ]HH:MM[:SS[.SSS]] and Z or +-HH:MM
+    // as in the SQLite date functions, a time without a zone is UTC (new Date() would use the local time zone)
+    // dates that do not exist, 24:00:00 with any other spelling and offsets beyond 14:00 are not parsed
+    static const int days_in_month[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    if (len < 10 || s[4] != '-' || s[7] != '-') return false;
+    int year = js_parse_digits(s, 4), month = js_parse_digits(s + 5, 2), day = js_parse_digits(s + 8, 2);
+    if (year < 0 || month < 1 || month > 12 || day < 1 || day > days_in_month[month - 1]) return false;
+    if (month == 2 && day == 29 && (year % 4 != 0 || (year % 100 == 0 && year % 400 != 0))) return false;
+    
+    int hour = 0, minute = 0, second = 0, ms = 0, offset = 0;
+    bool has_seconds = false;
+    int i = 10;
+    if (i < len && (s[i] == 'T' || s[i] == ' ')) {
+        if (i + 6 > len || s[i + 3] != ':') return false;
+        hour = js_parse_digits(s + i + 1, 2);
+        minute = js_parse_digits(s + i + 4, 2);
+        if (hour < 0 || hour > 24 || minute < 0 || minute > 59) return false;
+        i += 6;
+        
+        if (i < len && s[i] == ':') {
+            if (i + 3 > len) return false;
+            second = js_parse_digits(s + i + 1, 2);
+            if (second < 0 || second > 59) return false;
+            has_seconds = true;
+            i += 3;
+            
+            if (i < len && s[i] == '.') {
+                // milliseconds, any additional digit is ignored
+                int ndigits = 0;
+                for (++i; i < len && s[i] >= '0' && s[i] <= '9'; ++i) {
+                    if (ndigits < 3) ms = ms * 10 + (s[i] - '0');
+                    ++ndigits;
+                }
+                if (ndigits == 0) return false;
+                for (; ndigits < 3; ++ndigits) ms *= 10;
+            }
+        }
+        if (hour == 24 && (!has_seconds || minute != 0 || second != 0 || ms != 0)) return false;
+        
+        if (i < len && s[i] == 'Z') ++i;
+        else if (i < len && (s[i] == '+' || s[i] == '-')) {
+            if (i + 6 > len || s[i + 3] != ':') return false;
+            int oh = js_parse_digits(s + i + 1, 2), om = js_parse_digits(s + i + 4, 2);
+            if (oh < 0 || om < 0 || om > 59 || oh * 60 + om > 14 * 60) return false;
+            offset = (oh * 60 + om) * ((s[i] == '+') ? 1 : -1);
+            i += 6;
+        }
+    }
+    if (i != len) return false;
+    
+    int64_t seconds = js_days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second - offset * 60;
+    *epoch_ms = (double)(seconds * 1000 + ms);
+    return true;
+}
+
+static JSValue sqlite_value_to_js_date (JSContext *ctx, sqlite3_value *value) {
+    // INTEGER and REAL values are unix epoch seconds, TEXT values that are not ISO-8601 dates are passed unchanged
+    switch (sqlite3_value_type(value)) {
+        case SQLITE_INTEGER: return JS_NewDate(ctx, (double)sqlite3_value_int64(value) * 1000.0);
+        case SQLITE_FLOAT: return JS_NewDate(ctx, sqlite3_value_double(value) * 1000.0);
+        case SQLITE_TEXT: {
+            const char *text = (const char *)sqlite3_value_text(value);
+            double epoch_ms = 0;
+            if (text && js_parse_iso8601(text, sqlite3_value_bytes(value), &epoch_ms)) return JS_NewDate(ctx, epoch_ms);
+        } break;
+    }
+    return sqlite_value_to_js(ctx, value);
+}
+
+static void js_date_to_sqlite (sqlite3_context *context, JSContext *js_ctx, JSValueConst value, int result_type) {
+    // unix epoch seconds for functions declared integer or real, text in the SQLite datetime format otherwise
+    double time = 0;
+    if (JS_ToFloat64(js_ctx, &time, value) < 0) {
+        js_error_to_sqlite(context, js_ctx, JS_EXCEPTION, NULL);
+        return;
+    }
+    if (time != time) {
+        // Invalid Date
+        sqlite3_result_null(context);
+        return;
+    }
+    
+    int64_t t = (int64_t)time;
+    int64_t days = t / 86400000;
+    int64_t rem = t % 86400000;
+    if (rem < 0) {
+        rem += 86400000;
+        --days;
+    }
+    
+    if (result_type == SQLITE_FLOAT) {
+        sqlite3_result_double(context, time / 1000.0);
+        return;
+    }
+    if (result_type == SQLITE_INTEGER) {
+        sqlite3_result_int64(context, days * 86400 + rem / 1000);
+        return;
+    }
+    
+    int year, month, day;
+    js_civil_from_days(days, &year, &month, &day);
+    int ms = (int)(rem % 1000);
+    int seconds = (int)(rem / 1000);
+    
+    char buffer[64];
+    if (ms) sqlite3_snprintf(sizeof(buffer), buffer, "%04d-%02d-%02d %02d:%02d:%02d.%03d", year, month, day, seconds / 3600, (seconds / 60) % 60, seconds % 60, ms);
+    else sqlite3_snprintf(sizeof(buffer), buffer, "%04d-%02d-%02d %02d:%02d:%02d", year, month, day, seconds / 3600, (seconds / 60) % 60, seconds % 60);
+    sqlite3_result_text(context, buffer, -1, SQLITE_TRANSIENT);
+}
+
+// MARK: - JSON -
+
+// SQLite JSONB element types (low 4 bits of the header byte), see https://sqlite.org/jsonb.html
+#define JSONB_NULL                      0
+#define JSONB_TRUE                      1
+#define JSONB_FALSE                     2
+#define JSONB_INT                       3
+#define JSONB_INT5                      4
+#define JSONB_FLOAT                     5
+#define JSONB_FLOAT5                    6
+#define JSONB_TEXT                      7
+#define JSONB_TEXTJ                     8
+#define JSONB_TEXT5                     9
+#define JSONB_TEXTRAW                   10
+#define JSONB_ARRAY                     11
+#define JSONB_OBJECT                    12
+#define JSONB_MAX_DEPTH                 1000    // same nesting limit as the SQLite JSON functions
+#define JSONB_NUMBER_MAX_SIZE           350
+
+typedef struct {
+    uint8_t             *data;          // to release
+    size_t              size;
+    size_t              capacity;
+    JSAtom              to_json;        // to release, "toJSON" atom looked up on every object
+} jsonb_buffer;
+
+static int jsonb_header (const uint8_t *p, size_t n, size_t *header_size, size_t *payload_size) {
+    // returns the element type, or -1 if the header is truncated or the payload doesn't fit in n bytes
+    if (n == 0) return -1;
+    size_t nbytes = 0, size = p[0] >> 4;
+    if (size == 12) nbytes = 1;
+    else if (size == 13) nbytes = 2;
+    else if (size == 14) nbytes = 4;
+    else if (size == 15) nbytes = 8;
+    if (n < 1 + nbytes) return -1;
+    if (nbytes) {
+        size = 0;
+        for (size_t i=1; i<=nbytes; ++i) size = (size << 8) | p[i];
+    }
+    if (size > n - 1 - nbytes) return -1;
+    *header_size = 1 + nbytes;
+    *payload_size = size;
+    return p[0] & 0x0f;
+}
+
+static int jsonb_decode_number (JSContext *ctx, const char *s, size_t n, JSValue *out) {
+    // numbers are stored as text, they are converted like the JavaScript Number function (which does not depend
+    // on the C locale and also understands the JSON5 forms: Infinity, NaN, leading or trailing dot, hex digits)
+    JSValue str = JS_NewStringLen(ctx, s, n);
+    if (JS_IsException(str)) return -1;
+    double d = 0.0;
+    int rc = JS_ToFloat64(ctx, &d, str);
+    JS_FreeValue(ctx, str);
+    if (rc < 0) return -1;
+    if (d != d && (n < 3 || memcmp(s + n - 3, "NaN", 3) != 0)) return 0;
+    *out = JS_NewFloat64(ctx, d);
+    return 1;
+}
+
+static int jsonb_decode_int (JSContext *ctx, const char *s, size_t n, JSValue *out) {
+    // integers are decoded exactly in the safe integer range, outside of it they are rounded to the nearest
+    // number like JSON.parse does for JSON text (bigint does not apply to the values inside a JSON argument)
+    size_t i = 0;
+    bool negative = false;
+    if (i < n && (s[i] == '-' || s[i] == '+')) negative = (s[i++] == '-');
+    uint64_t base = 10;
+    size_t digits = i;
+    if (i + 1 < n && s[i] == '0' && (s[i+1] == 'x' || s[i+1] == 'X')) {
+        base = 16;
+        i += 2;
+    }
+    if (i == n) return 0;
+    
+    uint64_t value = 0;
+    bool exact = true;
+    for (; i<n; ++i) {
+        char c = s[i];
+        uint64_t digit;
+        if (c >= '0' && c <= '9') digit = (uint64_t)(c - '0');
+        else if (base == 16 && c >= 'a' && c <= 'f') digit = (uint64_t)(c - 'a' + 10);
+        else if (base == 16 && c >= 'A' && c <= 'F') digit = (uint64_t)(c - 'A' + 10);
+        else return 0;
+        if (value > ((uint64_t)MAX_SAFE_INTEGER - digit) / base) exact = false;
+        else value = value * base + digit;
+    }
+    
+    if (exact) {
+        *out = (negative && value == 0) ? JS_NewFloat64(ctx, -0.0) : JS_NewInt64(ctx, (negative) ? -(int64_t)value : (int64_t)value);
+        return 1;
+    }
+    
+    // the unsigned digits are rounded by jsonb_decode_number (Number does not accept a sign before 0x)
+    int rc = jsonb_decode_number(ctx, s + digits, n - digits, out);
+    if (rc == 1 && negative) *out = JS_NewFloat64(ctx, -JS_VALUE_GET_FLOAT64(*out));
+    return rc;
+}
+
+static int jsonb_decode (JSContext *ctx, const uint8_t *p, size_t n, int depth, size_t *consumed, JSValue *out) {
+    // returns 1 on success, 0 if the data is not valid (or uses an unsupported JSON5 text escape), -1 on a JS exception
+    size_t hsize = 0, size = 0;
+    int type = jsonb_header(p, n, &hsize, &size);
+    if (type < 0 || depth > JSONB_MAX_DEPTH) return 0;
+    const char *payload = (const char *)p + hsize;
+    *consumed = hsize + size;
+    
+    switch (type) {
+        case JSONB_NULL: *out = JS_NULL; return (size == 0);
+        case JSONB_TRUE: *out = JS_TRUE; return (size == 0);
+        case JSONB_FALSE: *out = JS_FALSE; return (size == 0);
+            
+        case JSONB_INT:
+        case JSONB_INT5:
+            if (size == 0) return 0;
+            return jsonb_decode_int(ctx, payload, size, out);
+            
+        case JSONB_FLOAT:
+        case JSONB_FLOAT5:
+            if (size == 0 || size > JSONB_NUMBER_MAX_SIZE) return 0;
+            return jsonb_decode_number(ctx, payload, size, out);
+            
+        case JSONB_TEXT:
+        case JSONB_TEXTRAW:
+            *out = JS_NewStringLen(ctx, payload, size);
+            return (JS_IsException(*out)) ? -1 : 1;
+            
+        case JSONB_TEXTJ: {
+            // JSON escapes are decoded by the QuickJS parser, the payload is the body of a valid JSON string
+            char *quoted = sqlite3_malloc64(size + 3);
+            if (!quoted) {
+                JS_ThrowOutOfMemory(ctx);
+                return -1;
+            }
+            quoted[0] = '"';
+            memcpy(quoted + 1, payload, size);
+            quoted[size + 1] = '"';
+            quoted[size + 2] = 0;
+            *out = JS_ParseJSON(ctx, quoted, size + 2, "<jsonb>");
+            sqlite3_free(quoted);
+            return (JS_IsException(*out)) ? -1 : 1;
+        }
+            
+        case JSONB_ARRAY:
+        case JSONB_OBJECT: {
+            bool is_array = (type == JSONB_ARRAY);
+            JSValue result = (is_array) ? JS_NewArray(ctx) : JS_NewObject(ctx);
+            if (JS_IsException(result)) return -1;
+            
+            const uint8_t *cur = (const uint8_t *)payload;
+            const uint8_t *end = cur + size;
+            uint32_t index = 0;
+            while (cur < end) {
+                size_t used = 0;
+                JSValue key = JS_UNDEFINED, value = JS_UNDEFINED;
+                int rc = 1;
+                if (!is_array) {
+                    // object labels must be text elements
+                    int label_type = jsonb_header(cur, (size_t)(end - cur), &hsize, &size);
+                    if (label_type != JSONB_TEXT && label_type != JSONB_TEXTJ && label_type != JSONB_TEXTRAW) rc = 0;
+                    else rc = jsonb_decode(ctx, cur, (size_t)(end - cur), depth + 1, &used, &key);
+                    cur += used;
+                    if (rc == 1 && cur >= end) {
+                        JS_FreeValue(ctx, key);
+                        rc = 0;
+                    }
+                }
+                if (rc == 1) {
+                    rc = jsonb_decode(ctx, cur, (size_t)(end - cur), depth + 1, &used, &value);
+                    if (rc != 1) JS_FreeValue(ctx, key);
+                    cur += used;
+                }
+                if (rc == 1) {
+                    if (is_array) {
+                        rc = (JS_DefinePropertyValueUint32(ctx, result, index++, value, JS_PROP_C_W_E) < 0) ? -1 : 1;
+                    } else {
+                        JSAtom atom = JS_ValueToAtom(ctx, key);
+                        JS_FreeValue(ctx, key);
+                        if (atom == JS_ATOM_NULL) {
+                            JS_FreeValue(ctx, value);
+                            rc = -1;
+                        } else {
+                            rc = (JS_DefinePropertyValue(ctx, result, atom, value, JS_PROP_C_W_E) < 0) ? -1 : 1;
+                            JS_FreeAtom(ctx, atom);
+                        }
+                    }
+                }
+                if (rc != 1) {
+                    JS_FreeValue(ctx, result);
+                    return rc;
+                }
+            }
+            *out = result;
+            return 1;
+        }
+    }
+    
+    // TEXT5 (JSON5 escapes) and reserved types
+    return 0;
+}
+
+static JSValue sqlite_value_to_js_json (JSContext *ctx, sqlite3_value *value) {
+    // JSON text of an object or array and JSONB blobs of an object or array are converted in C without
+    // going through a JS string, any other value (or invalid JSON) is passed unchanged
+    int type = sqlite3_value_type(value);
+    if (type == SQLITE_TEXT) {
+        const char *text = (const char *)sqlite3_value_text(value);
+        int len = sqlite3_value_bytes(value);
+        int i = 0;
+        while (i < len && (text[i] == ' ' || text[i] == '\t' || text[i] == '\n' || text[i] == '\r')) ++i;
+        if (i < len && (text[i] == '{' || text[i] == '[')) {
+            JSValue result = JS_ParseJSON(ctx, text, (size_t)len, "<json>");
+            if (!JS_IsException(result)) return result;
+            JS_FreeValue(ctx, JS_GetException(ctx));
+        }
+    } else if (type == SQLITE_BLOB) {
+        const uint8_t *blob = (const uint8_t *)sqlite3_value_blob(value);
+        size_t size = (size_t)sqlite3_value_bytes(value);
+        size_t hsize = 0, psize = 0, used = 0;
+        int jtype = (blob) ? jsonb_header(blob, size, &hsize, &psize) : -1;
+        if ((jtype == JSONB_ARRAY || jtype == JSONB_OBJECT) && hsize + psize == size) {
+            JSValue result = JS_UNDEFINED;
+            int rc = jsonb_decode(ctx, blob, size, 0, &used, &result);
+            if (rc == 1) return result;
+            if (rc < 0) return JS_EXCEPTION;
+        }
+    }
+    return sqlite_value_to_js(ctx, value);
+}
+
+static bool jsonb_reserve (JSContext *ctx, jsonb_buffer *b, size_t size) {
+    if (b->size + size <= b->capacity) return true;
+    size_t capacity = (b->capacity) ? b->capacity * 2 : 256;
+    while (capacity < b->size + size) capacity *= 2;
+    uint8_t *data = sqlite3_realloc64(b->data, capacity);
+    if (!data) {
+        JS_ThrowOutOfMemory(ctx);
+        return false;
+    }
+    b->data = data;
+    b->capacity = capacity;
+    return true;
+}
+
+static size_t jsonb_header_write (uint8_t *p, int type, size_t size) {
+    // smallest header able to store the payload size
+    size_t nbytes = 0;
+    uint8_t code = (uint8_t)size;
+    if (size > 11) {
+        if (size <= 0xff) { nbytes = 1; code = 12; }
+        else if (size <= 0xffff) { nbytes = 2; code = 13; }
+        else if (size <= 0xffffffff) { nbytes = 4; code = 14; }
+        else { nbytes = 8; code = 15; }
+    }
+    p[0] = (uint8_t)((code << 4) | type);
+    for (size_t i=0; i<nbytes; ++i) p[nbytes - i] = (uint8_t)(size >> (8 * i));
+    return 1 + nbytes;
+}
+
+static bool jsonb_append (JSContext *ctx, jsonb_buffer *b, int type, const char *payload, size_t size) {
+    if (!jsonb_reserve(ctx, b, size + 9)) return false;
+    b->size += jsonb_header_write(b->data + b->size, type, size);
+    if (size) memcpy(b->data + b->size, payload, size);
+    b->size += size;
+    return true;
+}
+
+static bool jsonb_append_string (JSContext *ctx, jsonb_buffer *b, int type, JSValueConst value) {
+    // strings are stored as TEXTRAW (no escapes needed), numbers and BigInts with their JS text representation
+    size_t len = 0;
+    const char *str = JS_ToCStringLen(ctx, &len, value);
+    if (!str) return false;
+    bool rc = jsonb_append(ctx, b, type, str, len);
+    JS_FreeCString(ctx, str);
+    return rc;
+}
+
+static int jsonb_encode (JSContext *ctx, jsonb_buffer *b, JSValueConst value, int depth) {
+    // same semantics as JSON.stringify: returns 1 when the value has been appended, 0 when it is skipped
+    // (undefined, functions and symbols), -1 on a JS exception; BigInts are stored as JSON integers
+    switch (JS_VALUE_GET_NORM_TAG(value)) {
+        case JS_TAG_NULL: return (jsonb_append(ctx, b, JSONB_NULL, NULL, 0)) ? 1 : -1;
+        case JS_TAG_BOOL: return (jsonb_append(ctx, b, JS_VALUE_GET_BOOL(value) ? JSONB_TRUE : JSONB_FALSE, NULL, 0)) ? 1 : -1;
+            
+        case JS_TAG_INT: {
+            char buffer[16];
+            int len = snprintf(buffer, sizeof(buffer), "%d", JS_VALUE_GET_INT(value));
+            return (jsonb_append(ctx, b, JSONB_INT, buffer, (size_t)len)) ? 1 : -1;
+        }
+            
+        case JS_TAG_FLOAT64: {
+            double d = JS_VALUE_GET_FLOAT64(value);
+            sqlite3_int64 n;
+            if (d != d || d - d != 0) return (jsonb_append(ctx, b, JSONB_NULL, NULL, 0)) ? 1 : -1;
+            if (js_number_is_integer(d, &n)) {
+                char buffer[24];
+                int len = snprintf(buffer, sizeof(buffer), "%lld", (long long)n);
+                return (jsonb_append(ctx, b, JSONB_INT, buffer, (size_t)len)) ? 1 : -1;
+            }
+            return (jsonb_append_string(ctx, b, JSONB_FLOAT, value)) ? 1 : -1;
+        }
+            
+        case JS_TAG_BIG_INT: return (jsonb_append_string(ctx, b, JSONB_INT, value)) ? 1 : -1;
+        case JS_TAG_STRING: return (jsonb_append_string(ctx, b, JSONB_TEXTRAW, value)) ? 1 : -1;
+        case JS_TAG_OBJECT: break;
+        default: return 0;
+    }
+    
+    if (JS_IsFunction(ctx, value)) return 0;
+    if (depth >= JSONB_MAX_DEPTH) {
+        JS_ThrowTypeError(ctx, "JSON value is cyclic or nested too deeply");
+        return -1;
+    }
+    
+    // toJSON (Date objects for example) replaces the object
+    JSValue to_json = JS_GetProperty(ctx, value, b->to_json);
+    if (JS_IsException(to_json)) return -1;
+    if (JS_IsFunction(ctx, to_json)) {
+        JSValue replaced = JS_Call(ctx, to_json, value, 0, NULL);
+        JS_FreeValue(ctx, to_json);
+        if (JS_IsException(replaced)) return -1;
+        int rc = jsonb_encode(ctx, b, replaced, depth + 1);
+        JS_FreeValue(ctx, replaced);
+        return rc;
+    }
+    JS_FreeValue(ctx, to_json);
+    
+    // the container header is written once the payload size is known, 9 bytes are reserved for the largest one
+    bool is_array = JS_IsArray(value);
+    if (!jsonb_reserve(ctx, b, 9)) return -1;
+    size_t start = b->size;
+    b->size += 9;
+    
+    if (is_array) {
+        int64_t length = 0;
+        if (JS_GetLength(ctx, value, &length) < 0) return -1;
+        for (int64_t i=0; i<length; ++i) {
+            JSValue item = JS_GetPropertyInt64(ctx, value, i);
+            if (JS_IsException(item)) return -1;
+            int rc = jsonb_encode(ctx, b, item, depth + 1);
+            JS_FreeValue(ctx, item);
+            if (rc < 0) return -1;
+            if (rc == 0 && !jsonb_append(ctx, b, JSONB_NULL, NULL, 0)) return -1;
+        }
+    } else {
+        JSPropertyEnum *props = NULL;
+        uint32_t nprops = 0;
+        if (JS_GetOwnPropertyNames(ctx, &props, &nprops, value, JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) < 0) return -1;
+        int rc = 1;
+        for (uint32_t i=0; i<nprops && rc >= 0; ++i) {
+            JSValue item = JS_GetProperty(ctx, value, props[i].atom);
+            if (JS_IsException(item)) {
+                rc = -1;
+                break;
+            }
+            
+            // the label is removed again if the value is skipped
+            size_t mark = b->size;
+            JSValue key = JS_AtomToString(ctx, props[i].atom);
+            rc = (!JS_IsException(key) && jsonb_append_string(ctx, b, JSONB_TEXTRAW, key)) ? 1 : -1;
+            JS_FreeValue(ctx, key);
+            if (rc > 0) rc = jsonb_encode(ctx, b, item, depth + 1);
+            if (rc == 0) b->size = mark;
+            JS_FreeValue(ctx, item);
+        }
+        JS_FreePropertyEnum(ctx, props, nprops);
+        if (rc < 0) return -1;
+    }
+    
+    size_t size = b->size - start - 9;
+    size_t hsize = jsonb_header_write(b->data + start, (is_array) ? JSONB_ARRAY : JSONB_OBJECT, size);
+    if (hsize != 9) memmove(b->data + start + hsize, b->data + start + 9, size);
+    b->size = start + hsize + size;
+    return 1;
+}
+
+static void js_json_to_sqlite (sqlite3_context *context, JSContext *js_ctx, JSValueConst value, int json_mode) {
+    // objects and arrays returned by a json function are JSON text (with the JSON subtype, so that the
+    // SQLite JSON functions don't quote it again), or a JSONB blob for a jsonb function
+    if (json_mode == JSON_MODE_TEXT) {
+        JSValue str = JS_JSONStringify(js_ctx, value, JS_UNDEFINED, JS_UNDEFINED);
+        if (JS_IsException(str)) {
+            js_error_to_sqlite(context, js_ctx, JS_EXCEPTION, NULL);
+            return;
+        }
+        size_t len = 0;
+        const char *text = (JS_IsString(str)) ? JS_ToCStringLen(js_ctx, &len, str) : NULL;
+        if (text) {
+            sqlite3_result_text64(context, text, (sqlite3_uint64)len, SQLITE_TRANSIENT, SQLITE_UTF8);
+            sqlite3_result_subtype(context, JSON_SUBTYPE);
+            JS_FreeCString(js_ctx, text);
+        } else {
+            sqlite3_result_null(context);
+        }
+        JS_FreeValue(js_ctx, str);
+        return;
+    }
+    
+    jsonb_buffer b = {0};
+    b.to_json = JS_NewAtom(js_ctx, "toJSON");
+    int rc = jsonb_encode(js_ctx, &b, value, 0);
+    JS_FreeAtom(js_ctx, b.to_json);
+    if (rc < 0) js_error_to_sqlite(context, js_ctx, JS_EXCEPTION, NULL);
+    else if (rc == 0) sqlite3_result_null(context);
+    else {
+        // the buffer is handed over to SQLite (which frees it even if the result cannot be set)
+        sqlite3_result_blob64(context, b.data, (sqlite3_uint64)b.size, sqlite3_free);
+        return;
+    }
+    if (b.data) sqlite3_free(b.data);
+}
+
 // MARK: - Utils -
 
-static JSValue js_sqlite_exec (JSContext *ctx, sqlite3 *db, const char *sql, int argc, JSValueConst *argv) {
-    sqlite3_stmt *vm = NULL;
-    const char *tail = NULL;
-    rowset *rs = NULL;
+static int js_binary_data (JSContext *ctx, JSValueConst value, const uint8_t **buffer, size_t *size) {
+    // returns 1 if value is an ArrayBuffer or a typed array (buffer is valid as long as value is alive), 0 if it isn't, -1 on exception
+    *buffer = NULL;
+    *size = 0;
+    
+    if (JS_IsArrayBuffer(value)) {
+        uint8_t *data = JS_GetArrayBuffer(ctx, size, value);
+        if (!data && *size) return -1;
+        *buffer = (data) ? data : (const uint8_t *)"";
+        return 1;
+    }
     
-    // compile statement
-    int rc = sqlite3_prepare_v2(db, sql, -1, &vm, &tail);
-    if (rc != SQLITE_OK) goto abort_with_dberror;
+    if (JS_GetTypedArrayType(value) >= 0) {
+        size_t offset = 0, total = 0;
+        JSValue abuffer = JS_GetTypedArrayBuffer(ctx, value, &offset, size, NULL);
+        if (JS_IsException(abuffer)) return -1;
+        uint8_t *data = JS_GetArrayBuffer(ctx, &total, abuffer);
+        JS_FreeValue(ctx, abuffer);
+        if (!data && *size) return -1;
+        *buffer = (data) ? data + offset : (const uint8_t *)"";
+        return 1;
+    }
+    
+    return 0;
+}
+
+static int js_bind_value (JSContext *ctx, sqlite3_stmt *vm, int index, JSValueConst value) {
+    // returns an SQLite error code, or -1 if a JS exception has been thrown
+    switch (JS_VALUE_GET_NORM_TAG(value)) {
+        case JS_TAG_INT:
+            return sqlite3_bind_int64(vm, index, (sqlite3_int64)JS_VALUE_GET_INT(value));
+        
+        case JS_TAG_FLOAT64: {
+            // integral numbers in the safe range are bound as INTEGER, the same rule used to read them back
+            sqlite3_int64 n = 0;
+            double d = JS_VALUE_GET_FLOAT64(value);
+            if (js_number_is_integer(d, &n)) return sqlite3_bind_int64(vm, index, n);
+            return sqlite3_bind_double(vm, index, d);
+        }
+        
+        case JS_TAG_BOOL:
+            return sqlite3_bind_int(vm, index, JS_VALUE_GET_BOOL(value) ? 1 : 0);
+        
+        case JS_TAG_NULL:
+        case JS_TAG_UNDEFINED:
+            return sqlite3_bind_null(vm, index);
+        
+        case JS_TAG_BIG_INT: {
+            sqlite3_int64 n = 0;
+            if (!js_bigint_to_int64(ctx, value, &n)) {
+                JS_ThrowRangeError(ctx, "BigInt parameter %d does not fit in a 64-bit INTEGER", index);
+                return -1;
+            }
+            return sqlite3_bind_int64(vm, index, n);
+        }
+        
+        case JS_TAG_STRING: {
+            size_t len = 0;
+            const char *str = JS_ToCStringLen(ctx, &len, value);
+            if (!str) return -1;
+            int rc = sqlite3_bind_text64(vm, index, str, (sqlite3_uint64)len, SQLITE_TRANSIENT, SQLITE_UTF8);
+            JS_FreeCString(ctx, str);
+            return rc;
+        }
+        
+        case JS_TAG_OBJECT: {
+            const uint8_t *buffer = NULL;
+            size_t size = 0;
+            int rc = js_binary_data(ctx, value, &buffer, &size);
+            if (rc < 0) return -1;
+            if (rc > 0) return sqlite3_bind_blob64(vm, index, buffer, (sqlite3_uint64)size, SQLITE_TRANSIENT);
+            break;
+        }
+    }
     
+    JS_ThrowTypeError(ctx, "Unsupported type for SQL parameter %d", index);
+    return -1;
+}
+
+static int js_bind_values (JSContext *ctx, sqlite3_stmt *vm, int argc, JSValueConst *argv) {
     // count if statement contains bindings
     int nbind = sqlite3_bind_parameter_count(vm);
-    if (nbind > 0 && argc > 0) {
-        // loop to bind
-        if (nbind > argc) nbind = argc;
-        for (int i=1; i<=nbind; ++i) {
+    if (nbind == 0 || argc == 0) return SQLITE_OK;
+    
+    // a single plain object binds named parameters (:name, @name, $name) and a single array binds positional parameters
+    bool is_object = (argc == 1 && JS_IsObject(argv[0]) && !JS_IsArray(argv[0]) && !JS_IsArrayBuffer(argv[0]) && JS_GetTypedArrayType(argv[0]) < 0);
+    bool is_array = (argc == 1 && JS_IsArray(argv[0]));
+    
+    for (int i=1; i<=nbind; ++i) {
+        JSValue value = JS_UNDEFINED;
+        
+        if (is_object) {
+            const char *name = sqlite3_bind_parameter_name(vm, i);
+            if (!name || name[0] == '?') continue;
             
+            // a missing property is an error (a property set to undefined or null binds NULL)
+            JSAtom atom = JS_NewAtom(ctx, name + 1);
+            if (atom == JS_ATOM_NULL) return -1;
+            int has = JS_HasProperty(ctx, argv[0], atom);
+            if (has == 0) JS_ThrowReferenceError(ctx, "Missing value for SQL parameter %s", name);
+            value = (has > 0) ? JS_GetProperty(ctx, argv[0], atom) : JS_EXCEPTION;
+            JS_FreeAtom(ctx, atom);
+        } else if (is_array) {
+            value = JS_GetPropertyUint32(ctx, argv[0], (uint32_t)(i - 1));
+        } else {
+            if (i > argc) break;
+            value = JS_DupValue(ctx, argv[i-1]);
         }
+        if (JS_IsException(value)) return -1;
+        
+        int rc = js_bind_value(ctx, vm, i, value);
+        JS_FreeValue(ctx, value);
+        if (rc != SQLITE_OK) return rc;
     }
     
+    return SQLITE_OK;
+}
+
+static JSValue js_sqlite_exec (JSContext *ctx, sqlite3 *db, const char *sql, int argc, JSValueConst *argv) {
+    globaljs_context *js = JS_GetContextOpaque(ctx);
+    sqlite3_stmt *vm = NULL;
+    rowset *rs = NULL;
+    JSValue obj = JS_EXCEPTION;
+    
+    // compile statement (or reuse a cached one)
+    js_close_hook_install(js);
+    int rc = jsstmt_prepare(db, &js->stmt_cache, sql, &vm);
+    if (rc != SQLITE_OK) goto abort_with_dberror;
+    
+    // bind parameters
+    rc = js_bind_values(ctx, vm, argc, argv);
+    if (rc == -1) goto abort_with_jserror;
+    if (rc != SQLITE_OK) goto abort_with_dberror;
+    
     // create and initialize internal rowset
     rs = (rowset *)sqlite3_malloc(sizeof(rowset));
-    if (!rs) goto abort_with_dberror;
+    if (!rs) {
+        obj = JS_ThrowOutOfMemory(ctx);
+        goto abort_with_jserror;
+    }
     rs->vm = vm;
     rs->ncols = sqlite3_column_count(vm);
+    rs->atoms = NULL;
     
     // create Rowset JS object
-    globaljs_context *js = JS_GetContextOpaque(ctx);    
-    JSValue obj = JS_NewObjectClass(ctx, js->rowSetClassID);
+    obj = JS_NewObjectClass(ctx, js->rowSetClassID);
     if (JS_IsException(obj)) goto abort_with_jserror;
     JS_SetOpaque(obj, rs);
     JS_SetPropertyStr(ctx, obj, "columnCount", JS_NewInt32(ctx, rs->ncols));
@@ -361,19 +2645,12 @@ static JSValue js_sqlite_exec (JSContext *ctx, sqlite3 *db, const char *sql, int
     return obj;
     
 abort_with_dberror:
-    if (rs) {
-        if (rs->vm) rs->vm = NULL;
-        sqlite3_free(rs);
-    }
-    if (vm) sqlite3_finalize(vm);
-    return JS_ThrowInternalError(ctx, "%s", sqlite3_errmsg(db));
+    // error message must be retrieved before the statement is released
+    obj = JS_ThrowInternalError(ctx, "%s", sqlite3_errmsg(db));
     
 abort_with_jserror:
-    if (rs) {
-        if (rs->vm) rs->vm = NULL;
-        sqlite3_free(rs);
-    }
-    if (vm) sqlite3_finalize(vm);
+    if (rs) sqlite3_free(rs);
+    if (vm) jsstmt_release(&js->stmt_cache, vm);
     return obj;
 }
 
@@ -388,7 +2665,7 @@ static JSValue js_dbfunc_exec (JSContext *ctx, JSValueConst this_val, int argc,
     
     // perform statement
     globaljs_context *js = JS_GetContextOpaque(ctx);
-    JSValue value = js_sqlite_exec(ctx, js->db, sql, argc-1, argv);
+    JSValue value = js_sqlite_exec(ctx, js->db, sql, argc-1, argv+1);
     
     // free the string when done
     JS_FreeCString(ctx, sql);
@@ -396,6 +2673,67 @@ static JSValue js_dbfunc_exec (JSContext *ctx, JSValueConst this_val, int argc,
     return value;
 }
 
+static JSValue js_dbfunc_prepare (JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    (void)this_val;
+    if (argc < 1) return JS_ThrowTypeError(ctx, "db.prepare requires an SQL string");
+    
+    const char *sql = JS_ToCString(ctx, argv[0]);
+    if (!sql) return JS_EXCEPTION;
+    
+    // statement is meant to be executed many times
+    globaljs_context *js = JS_GetContextOpaque(ctx);
+    js_close_hook_install(js);
+    sqlite3_stmt *vm = NULL;
+    const char *tail = NULL;
+    int rc = sqlite3_prepare_v3(js->db, sql, -1, SQLITE_PREPARE_PERSISTENT, &vm, &tail);
+    
+    // anything after the first statement would be silently ignored, only whitespace and comments
+    // (which SQLite compiles to no statement at all) are accepted
+    bool single = true;
+    if (rc == SQLITE_OK && vm && tail && *tail) {
+        sqlite3_stmt *next = NULL;
+        single = (sqlite3_prepare_v2(js->db, tail, -1, &next, NULL) == SQLITE_OK && next == NULL);
+        sqlite3_finalize(next);
+    }
+    JS_FreeCString(ctx, sql);
+    if (rc != SQLITE_OK) return JS_ThrowInternalError(ctx, "%s", sqlite3_errmsg(js->db));
+    if (!vm) return JS_ThrowTypeError(ctx, "db.prepare requires a non empty SQL statement");
+    if (!single) {
+        sqlite3_finalize(vm);
+        return JS_ThrowTypeError(ctx, "db.prepare accepts a single SQL statement");
+    }
+    
+    jsstatement *stmt = (jsstatement *)sqlite3_malloc(sizeof(jsstatement));
+    char *sql_copy = sqlite_strdup(sqlite3_sql(vm));
+    if (!stmt || !sql_copy) {
+        if (stmt) sqlite3_free(stmt);
+        if (sql_copy) sqlite3_free(sql_copy);
+        sqlite3_finalize(vm);
+        return JS_ThrowOutOfMemory(ctx);
+    }
+    stmt->vm = vm;
+    stmt->sql = sql_copy;
+    stmt->ncols = sqlite3_column_count(vm);
+    
+    JSValue obj = JS_NewObjectClass(ctx, js->statementClassID);
+    if (JS_IsException(obj)) {
+        sqlite3_finalize(vm);
+        sqlite3_free(sql_copy);
+        sqlite3_free(stmt);
+        return obj;
+    }
+    JS_SetOpaque(obj, stmt);
+    
+    // keep track of the statement so it can be released by js_release
+    stmt->prev = NULL;
+    stmt->next = js->statements;
+    if (js->statements) js->statements->prev = stmt;
+    js->statements = stmt;
+    JS_SetPropertyStr(ctx, obj, "columnCount", JS_NewInt32(ctx, stmt->ncols));
+    
+    return obj;
+}
+
 static bool js_global_init (JSContext *ctx, globaljs_context *js) {
     js_std_add_helpers(ctx, 0, NULL);
     
@@ -405,6 +2743,7 @@ static bool js_global_init (JSContext *ctx, globaljs_context *js) {
     // create a new db object
     JSValue db_obj =  JS_NewObject(ctx);
     JS_SetPropertyStr(ctx, db_obj, "exec", JS_NewCFunction(ctx, js_dbfunc_exec, "exec", 1));
+    JS_SetPropertyStr(ctx, db_obj, "prepare", JS_NewCFunction(ctx, js_dbfunc_prepare, "prepare", 1));
     JS_SetPropertyStr(ctx, global_obj, "db", db_obj);
     
     // register rowset class
@@ -414,6 +2753,24 @@ static bool js_global_init (JSContext *ctx, globaljs_context *js) {
     JS_SetPropertyFunctionList(ctx, proto, js_rowset_proto_funcs, sizeof(js_rowset_proto_funcs)/sizeof(js_rowset_proto_funcs[0]));
     JS_SetClassProto(ctx, js->rowSetClassID, proto);
     
+    // register row iterator class (inherits from Iterator.prototype so iterator helpers are available)
+    JS_NewClassID(js->runtime, &js->rowIteratorClassID);
+    JS_NewClass(js->runtime, js->rowIteratorClassID, &js_rowiterator_class);
+    JSValue iterator_ctor = JS_GetPropertyStr(ctx, global_obj, "Iterator");
+    JSValue iterator_proto = JS_GetPropertyStr(ctx, iterator_ctor, "prototype");
+    proto = (JS_IsObject(iterator_proto)) ? JS_NewObjectProto(ctx, iterator_proto) : JS_NewObject(ctx);
+    JS_FreeValue(ctx, iterator_proto);
+    JS_FreeValue(ctx, iterator_ctor);
+    JS_SetPropertyFunctionList(ctx, proto, js_rowiterator_proto_funcs, sizeof(js_rowiterator_proto_funcs)/sizeof(js_rowiterator_proto_funcs[0]));
+    JS_SetClassProto(ctx, js->rowIteratorClassID, proto);
+    
+    // register statement class
+    JS_NewClassID(js->runtime, &js->statementClassID);
+    JS_NewClass(js->runtime, js->statementClassID, &js_statement_class);
+    proto = JS_NewObject(ctx);
+    JS_SetPropertyFunctionList(ctx, proto, js_statement_proto_funcs, sizeof(js_statement_proto_funcs)/sizeof(js_statement_proto_funcs[0]));
+    JS_SetClassProto(ctx, js->statementClassID, proto);
+    
     // register standard modules
     js_init_module_std(ctx, "std");
     js_init_module_os(ctx, "os");
@@ -426,6 +2783,59 @@ static bool js_global_init (JSContext *ctx, globaljs_context *js) {
     return true;
 }
 
+static void js_global_snapshot (JSContext *ctx, globaljs_context *js) {
+    // remember the global properties of a freshly initialized context (only once)
+    if (js->global_atoms) return;
+    
+    JSValue global_obj = JS_GetGlobalObject(ctx);
+    JSPropertyEnum *props = NULL;
+    uint32_t len = 0;
+    
+    if (JS_GetOwnPropertyNames(ctx, &props, &len, global_obj, JS_GPN_STRING_MASK | JS_GPN_SYMBOL_MASK) == 0) {
+        JSAtom *atoms = (JSAtom *)sqlite3_malloc((int)(sizeof(JSAtom) * (len + 1)));
+        for (uint32_t i = 0; i < len; i++) {
+            if (atoms) atoms[i] = props[i].atom;
+            else JS_FreeAtom(ctx, props[i].atom);
+        }
+        if (atoms) {
+            js->global_atoms = atoms;
+            js->nglobal_atoms = len;
+        }
+        js_free(ctx, props);
+    }
+    
+    JS_FreeValue(ctx, global_obj);
+}
+
+static void js_global_reset (JSContext *ctx, globaljs_context *js) {
+    // delete every global property that was not present in a freshly initialized context, non configurable
+    // properties (like var declarations) cannot be deleted so they are set to undefined, as in a new context
+    if (!js->global_atoms) return;
+    
+    JSValue global_obj = JS_GetGlobalObject(ctx);
+    JSPropertyEnum *props = NULL;
+    uint32_t len = 0;
+    
+    if (JS_GetOwnPropertyNames(ctx, &props, &len, global_obj, JS_GPN_STRING_MASK | JS_GPN_SYMBOL_MASK) == 0) {
+        for (uint32_t i = 0; i < len; i++) {
+            JSAtom atom = props[i].atom;
+            
+            bool found = false;
+            for (uint32_t j = 0; j < js->nglobal_atoms; j++) {
+                if (js->global_atoms[j] == atom) {found = true; break;}
+            }
+            if (!found && JS_DeleteProperty(ctx, global_obj, atom, 0) != 1) {
+                if (JS_SetProperty(ctx, global_obj, atom, JS_UNDEFINED) < 0) JS_FreeValue(ctx, JS_GetException(ctx));
+            }
+            
+            JS_FreeAtom(ctx, atom);
+        }
+        js_free(ctx, props);
+    }
+    
+    JS_FreeValue(ctx, global_obj);
+}
+
 static void js_dump_globals (JSContext *ctx) {
     JSValue global_obj = JS_GetGlobalObject(ctx);
     JSPropertyEnum *props;
@@ -469,7 +2879,7 @@ static void js_error_to_sqlite (sqlite3_context *context, JSContext *js_ctx, JSV
     JSValue exception = JS_NULL;
     
     if (JS_IsException(value)) {
-        JSValue exception = JS_GetException(js_ctx);
+        exception = JS_GetException(js_ctx);
         if (JS_IsObject(exception)) {
             JSValue message = JS_GetPropertyStr(js_ctx, exception, "message");
             if (!JS_IsException(message) && JS_IsString(message)) {
@@ -488,122 +2898,216 @@ static void js_error_to_sqlite (sqlite3_context *context, JSContext *js_ctx, JSV
     if (!JS_IsNull(exception)) JS_FreeValue(js_ctx, exception);
 }
 
-static void js_value_to_sqlite (sqlite3_context *context, JSContext *js_ctx, JSValue value) {
-    // check for exceptions first and convert it to a proper error message (if any)
-    if (JS_IsException(value)) {
-        js_error_to_sqlite(context, js_ctx, value, NULL);
-        return;
+static bool js_number_is_integer (double d, sqlite3_int64 *n) {
+    // QuickJS tags only int32 values as integers, this also accepts every other integral number in the safe range
+    if (!(d >= -MAX_SAFE_INTEGER && d <= MAX_SAFE_INTEGER)) return false;
+    sqlite3_int64 i = (sqlite3_int64)d;
+    if ((double)i != d) return false;
+    *n = i;
+    return true;
+}
+
+static bool js_bigint_to_int64 (JSContext *ctx, JSValueConst value, sqlite3_int64 *n) {
+    // JS_ToBigInt64 wraps modulo 2^64, so the value is converted back to check that nothing was lost
+    int64_t i = 0;
+    if (JS_ToBigInt64(ctx, &i, value) < 0) {
+        JS_FreeValue(ctx, JS_GetException(ctx));
+        return false;
     }
-    
-    // check for null or undefined
-    if (JS_IsNull(value) || JS_IsUndefined(value)) {
-        sqlite3_result_null(context);
-        return;
+    JSValue check = JS_NewBigInt64(ctx, i);
+    bool exact = JS_IsStrictEqual(ctx, check, value);
+    JS_FreeValue(ctx, check);
+    if (exact) *n = (sqlite3_int64)i;
+    return exact;
+}
+
+static int js_number_to_sqlite (JSValueConst value, const functionjs_options *options, sqlite3_int64 *n, double *d) {
+    // returns the SQLite type of a number (SQLITE_INTEGER or SQLITE_FLOAT) according to the declared result type (0 if none),
+    // a number that QuickJS does not tag as an integer is REAL unless the function is declared with returns=integer or bigint
+    int result_type = (options) ? options->result_type : 0;
+    if (JS_VALUE_GET_TAG(value) == JS_TAG_INT) {
+        *n = JS_VALUE_GET_INT(value);
+        *d = (double)*n;
+        return (result_type == SQLITE_FLOAT) ? SQLITE_FLOAT : SQLITE_INTEGER;
     }
     
-    // handle numbers
-    if (JS_IsNumber(value)) {
-        int tag = JS_VALUE_GET_TAG(value);
-        if (tag == JS_TAG_INT) {
-            int32_t num;
-            JS_ToInt32(js_ctx, &num, value);
-            sqlite3_result_int(context, num);
-        } else if (tag == JS_TAG_FLOAT64) {
-            double num;
-            JS_ToFloat64(js_ctx, &num, value);
-            sqlite3_result_double(context, num);
-        } else {
-            // handle BigInt if needed
+    *d = JS_VALUE_GET_FLOAT64(value);
+    if (result_type == SQLITE_FLOAT) return SQLITE_FLOAT;
+    if (result_type == SQLITE_INTEGER && *d >= -9223372036854775808.0 && *d < 9223372036854775808.0) {
+        // truncated like CAST(x AS INTEGER)
+        *n = (sqlite3_int64)*d;
+        return SQLITE_INTEGER;
+    }
+    return (options && options->bigint && js_number_is_integer(*d, n)) ? SQLITE_INTEGER : SQLITE_FLOAT;
+}
+
+static void js_value_to_sqlite_typed (sqlite3_context *context, JSContext *js_ctx, JSValue value, const functionjs_options *options) {
+    int result_type = (options) ? options->result_type : 0;
+    
+    // a single dispatch on the value tag, the payload of primitive values is read directly
+    switch (JS_VALUE_GET_NORM_TAG(value)) {
+        case JS_TAG_EXCEPTION:
+            // convert the pending exception to a proper error message (if any)
+            js_error_to_sqlite(context, js_ctx, value, NULL);
+            return;
+            
+        case JS_TAG_NULL:
+        case JS_TAG_UNDEFINED:
             sqlite3_result_null(context);
+            return;
+            
+        case JS_TAG_INT:
+        case JS_TAG_FLOAT64: {
+            sqlite3_int64 n = 0;
+            double d = 0.0;
+            if (js_number_to_sqlite(value, options, &n, &d) == SQLITE_INTEGER) sqlite3_result_int64(context, n);
+            else sqlite3_result_double(context, d);
+            return;
         }
-        return;
-    }
-    
-    // handle booleans
-    if (JS_IsBool(value)) {
-        sqlite3_result_int(context, JS_ToBool(js_ctx, value));
-        return;
-    }
-    
-    // handle strings
-    if (JS_IsString(value)) {
-        size_t len = 0;
-        const char * str= JS_ToCStringLen(js_ctx, &len, value);
-        if (str) {
-            sqlite3_result_text(context, str, (int)len, SQLITE_TRANSIENT);
-            JS_FreeCString(js_ctx, str);
-        } else {
-            sqlite3_result_error(context, "Failed to convert JS string", -1);
+            
+        case JS_TAG_BOOL:
+            sqlite3_result_int(context, JS_VALUE_GET_BOOL(value) ? 1 : 0);
+            return;
+            
+        case JS_TAG_BIG_INT: {
+            // an error if it doesn't fit in a 64-bit integer, never a silently truncated value
+            sqlite3_int64 n;
+            if (js_bigint_to_int64(js_ctx, value, &n)) sqlite3_result_int64(context, n);
+            else sqlite3_result_error(context, "BigInt value is out of the 64-bit integer range", -1);
+            return;
+        }
+            
+        case JS_TAG_STRING: {
+            // for ASCII strings QuickJS returns its own buffer (no conversion), so the copy made by SQLite is the only one
+            size_t len = 0;
+            const char *str = JS_ToCStringLen(js_ctx, &len, value);
+            if (str) {
+                sqlite3_result_text64(context, str, (sqlite3_uint64)len, SQLITE_TRANSIENT, SQLITE_UTF8);
+                JS_FreeCString(js_ctx, str);
+            } else {
+                sqlite3_result_error(context, "Failed to convert JS string", -1);
+            }
+            return;
+        }
+            
+        case JS_TAG_OBJECT: {
+            if (JS_IsDate(value)) {
+                js_date_to_sqlite(context, js_ctx, value, result_type);
+                return;
+            }
+            
+            // ArrayBuffer and typed arrays are returned as BLOB, other objects as JSON by json functions or as NULL
+            const uint8_t *buffer = NULL;
+            size_t size = 0;
+            int rc = js_binary_data(js_ctx, value, &buffer, &size);
+            if (rc > 0) sqlite3_result_blob64(context, buffer, (sqlite3_uint64)size, SQLITE_TRANSIENT);
+            else if (rc < 0) js_error_to_sqlite(context, js_ctx, JS_EXCEPTION, NULL);
+            else if (options && options->json_mode) js_json_to_sqlite(context, js_ctx, value, options->json_mode);
+            else sqlite3_result_null(context);
+            return;
         }
-        return;
-    }
-    
-    if (JS_IsObject(value)) {
-        sqlite3_result_null(context);
-        return;
     }
     
     // fallback for unsupported types
     sqlite3_result_error(context, "Unsupported JS value type", -1);
 }
 
-static bool js_setup_aggregate (sqlite3_context *context, globaljs_context *js, functionjs_aggregate_context *agg_ctx, const char *init_code, const char *step_code, const char *final_code, const char *value_code, const char *inverse_code) {
-    bool result = false;
-    
-    if (agg_ctx) {
-        // initialize aggregate context functions with null values
-        agg_ctx->step_func = JS_NULL;
-        agg_ctx->final_func = JS_NULL;
-        agg_ctx->value_func = JS_NULL;
-        agg_ctx->inverse_func = JS_NULL;
-    }
-    
-    // create a separate context for testing purpose
-    JSContext *ctx = JS_NewContext(js->runtime);
-    if (!ctx) {
-        sqlite3_result_error(context, "Unable to create a JS context.", -1);
-        return false;
+static void js_value_to_sqlite (sqlite3_context *context, JSContext *js_ctx, JSValue value) {
+    js_value_to_sqlite_typed(context, js_ctx, value, NULL);
+}
+
+static bool js_compile_bytecode (sqlite3_context *context, functionjs_context *fctx, const char *code[FUNCTION_CODE_COUNT], const void *blob, int blob_size) {
+    // every code piece is compiled only once and kept serialized, because compiled bytecode is bound to
+    // the context it was created in (and each aggregate group needs its own context), persisted bytecode
+    // loaded from the js_functions table is reused as is so that the source code is not parsed at all
+    JSContext *ctx = fctx->js_ctx->context;
+    const uint8_t *persisted[FUNCTION_CODE_COUNT] = {NULL};
+    size_t persisted_size[FUNCTION_CODE_COUNT] = {0};
+    if (blob) js_bytecode_unpack(blob, blob_size, code, persisted, persisted_size);
+    
+    for (int i=0; i<FUNCTION_CODE_COUNT; ++i) {
+        if (!code[i]) continue;
+        
+        if (persisted[i]) {
+            fctx->bytecode[i] = (uint8_t *)js_malloc(ctx, persisted_size[i]);
+            if (!fctx->bytecode[i]) {
+                sqlite3_result_error_nomem(context);
+                return false;
+            }
+            memcpy(fctx->bytecode[i], persisted[i], persisted_size[i]);
+            fctx->bytecode_size[i] = persisted_size[i];
+            continue;
+        }
+        
+        JSValue value = JS_Eval(ctx, code[i], strlen(code[i]), NULL, JS_EVAL_TYPE_GLOBAL | JS_EVAL_FLAG_COMPILE_ONLY);
+        if (JS_IsException(value)) {
+            js_error_to_sqlite(context, ctx, value, NULL);
+            return false;
+        }
+        
+        fctx->bytecode[i] = JS_WriteObject(ctx, &fctx->bytecode_size[i], value, JS_WRITE_OBJ_BYTECODE);
+        JS_FreeValue(ctx, value);
+        if (!fctx->bytecode[i]) {
+            sqlite3_result_error_nomem(context);
+            return false;
+        }
     }
     
-    // setup global object
-    JS_SetContextOpaque(ctx, js);
-    js_global_init(ctx, js);
+    return true;
+}
+
+static JSValue js_eval_bytecode (JSContext *ctx, functionjs_context *fctx, int index) {
+    if (!fctx->bytecode[index]) return JS_NULL;
     
-    // init code is optional
-    if (init_code) {
-        JSValue result = JS_Eval(ctx, init_code, strlen(init_code), NULL, JS_EVAL_TYPE_GLOBAL);
-        bool is_error = JS_IsException(result);
-        if (is_error) js_error_to_sqlite(context, ctx, result, NULL);
-        JS_FreeValue(ctx, result);
-        if (is_error) return false;
+    JSValue value = JS_ReadObject(ctx, fctx->bytecode[index], fctx->bytecode_size[index], JS_READ_OBJ_BYTECODE);
+    if (JS_IsException(value)) {
+        // persisted bytecode that cannot be read back is replaced by a fresh compilation of the source code
+        const char *code[FUNCTION_CODE_COUNT] = {fctx->init_code, fctx->step_code, fctx->final_code, fctx->value_code, fctx->inverse_code};
+        JS_FreeValue(ctx, JS_GetException(ctx));
+        
+        value = JS_Eval(ctx, code[index], strlen(code[index]), NULL, JS_EVAL_TYPE_GLOBAL | JS_EVAL_FLAG_COMPILE_ONLY);
+        if (JS_IsException(value)) return value;
+        
+        size_t size = 0;
+        uint8_t *bytecode = JS_WriteObject(ctx, &size, value, JS_WRITE_OBJ_BYTECODE);
+        if (bytecode) {
+            js_free(ctx, fctx->bytecode[index]);
+            fctx->bytecode[index] = bytecode;
+            fctx->bytecode_size[index] = size;
+        }
     }
     
+    // JS_EvalFunction takes ownership of its argument
+    return JS_EvalFunction(ctx, value);
+}
+
+static bool js_eval_aggregate_functions (sqlite3_context *context, JSContext *ctx, functionjs_context *fctx, functionjs_aggregate_context *agg_ctx) {
+    // the functions are stored in agg_ctx (if any) or released, errors are reported to context (if any)
+    bool result = false;
     JSValue step_func = JS_NULL;
     JSValue final_func = JS_NULL;
     JSValue value_func = JS_NULL;
     JSValue inverse_func = JS_NULL;
     
     // generate JavaScript functions
-    step_func = JS_Eval(ctx, step_code, strlen(step_code), NULL, JS_EVAL_TYPE_GLOBAL);
+    step_func = js_eval_bytecode(ctx, fctx, FUNCTION_CODE_STEP);
     if (!JS_IsFunction(ctx, step_func)) goto cleanup;
     
-    final_func = JS_Eval(ctx, final_code, strlen(final_code), NULL, JS_EVAL_TYPE_GLOBAL);
+    final_func = js_eval_bytecode(ctx, fctx, FUNCTION_CODE_FINAL);
     if (!JS_IsFunction(ctx, final_func)) goto cleanup;
     
-    if (value_code) {
-        value_func = JS_Eval(ctx, value_code, strlen(value_code), NULL, JS_EVAL_TYPE_GLOBAL);
+    if (fctx->bytecode[FUNCTION_CODE_VALUE]) {
+        value_func = js_eval_bytecode(ctx, fctx, FUNCTION_CODE_VALUE);
         if (!JS_IsFunction(ctx, value_func)) goto cleanup;
     }
     
-    if (inverse_code) {
-        inverse_func = JS_Eval(ctx, inverse_code, strlen(inverse_code), NULL, JS_EVAL_TYPE_GLOBAL);
+    if (fctx->bytecode[FUNCTION_CODE_INVERSE]) {
+        inverse_func = js_eval_bytecode(ctx, fctx, FUNCTION_CODE_INVERSE);
         if (!JS_IsFunction(ctx, inverse_func)) goto cleanup;
     }
     
     // when here I am sure everything is OK
     if (agg_ctx) {
-        // setup a proper function aggregate context
-        agg_ctx->context = ctx;
         agg_ctx->step_func = step_func;
         agg_ctx->final_func = final_func;
         agg_ctx->value_func = value_func;
@@ -614,127 +3118,680 @@ static bool js_setup_aggregate (sqlite3_context *context, globaljs_context *js,
     result = true;
     
 cleanup:
-    if (!result) {
+    if (!result && context) {
         if (!JS_IsFunction(ctx, step_func)) js_error_to_sqlite(context, ctx, step_func, "JavaScript step code must evaluate to a function in the form (function(args){ your_code_here })");
         else if (!JS_IsFunction(ctx, final_func)) js_error_to_sqlite(context, ctx, final_func, "JavaScript final code must evaluate to a function in the form (function(){ your_code_here })");
-        else if (!JS_IsFunction(ctx, value_func)) js_error_to_sqlite(context, ctx, final_func, "JavaScript value code must evaluate to a function in the form (function(){ your_code_here })");
-        else if (!JS_IsFunction(ctx, inverse_func)) js_error_to_sqlite(context, ctx, step_func, "JavaScript inverse code must evaluate to a function in the form (function(args){ your_code_here })");
+        else if (!JS_IsFunction(ctx, value_func)) js_error_to_sqlite(context, ctx, value_func, "JavaScript value code must evaluate to a function in the form (function(){ your_code_here })");
+        else if (!JS_IsFunction(ctx, inverse_func)) js_error_to_sqlite(context, ctx, inverse_func, "JavaScript inverse code must evaluate to a function in the form (function(args){ your_code_here })");
     }
     
     JS_FreeValue(ctx, step_func);
     JS_FreeValue(ctx, final_func);
     JS_FreeValue(ctx, value_func);
     JS_FreeValue(ctx, inverse_func);
+    return result;
+}
+
+static bool js_setup_aggregate (sqlite3_context *context, globaljs_context *js, functionjs_aggregate_context *agg_ctx, functionjs_context *fctx) {
+    if (agg_ctx) {
+        // initialize aggregate context functions with null values
+        agg_ctx->state = JS_NULL;
+        agg_ctx->step_func = JS_NULL;
+        agg_ctx->final_func = JS_NULL;
+        agg_ctx->value_func = JS_NULL;
+        agg_ctx->inverse_func = JS_NULL;
+    }
+    
+    // create a separate context for testing purpose
+    JSContext *ctx = JS_NewContext(js->runtime);
+    if (!ctx) {
+        sqlite3_result_error(context, "Unable to create a JS context.", -1);
+        return false;
+    }
+    
+    // setup global object
+    JS_SetContextOpaque(ctx, js);
+    js_global_init(ctx, js);
+    if (agg_ctx) js_global_snapshot(ctx, js);
+    
+    // init code is optional
+    if (fctx->bytecode[FUNCTION_CODE_INIT]) {
+        JSValue result = js_eval_bytecode(ctx, fctx, FUNCTION_CODE_INIT);
+        bool is_error = JS_IsException(result);
+        if (is_error) js_error_to_sqlite(context, ctx, result, NULL);
+        JS_FreeValue(ctx, result);
+        if (is_error) {
+            JS_FreeContext(ctx);
+            return false;
+        }
+    }
+    
+    bool result = js_eval_aggregate_functions(context, ctx, fctx, agg_ctx);
+    if (result && agg_ctx) {
+        // setup a proper function aggregate context
+        agg_ctx->context = ctx;
+        agg_ctx->owns_context = true;
+        return true;
+    }
+    
+    JS_FreeContext(ctx);
+    return result;
+}
+
+
+static bool js_setup_state (sqlite3_context *context, functionjs_context *fctx, functionjs_aggregate_context *agg_ctx) {
+    // state mode: functions are shared and compiled once, each group only owns its state object
+    JSContext *ctx = fctx->js_ctx->context;
+    
+    JSValue state = (JS_IsNull(fctx->init_func)) ? JS_NewObject(ctx) : JS_Call(ctx, fctx->init_func, JS_UNDEFINED, 0, NULL);
+    if (JS_IsException(state)) {
+        js_error_to_sqlite(context, ctx, state, NULL);
+        return false;
+    }
+    
+    agg_ctx->context = ctx;
+    agg_ctx->owns_context = false;
+    agg_ctx->state = state;
+    agg_ctx->step_func = JS_DupValue(ctx, fctx->step_func);
+    agg_ctx->final_func = JS_DupValue(ctx, fctx->final_func);
+    agg_ctx->value_func = JS_DupValue(ctx, fctx->value_func);
+    agg_ctx->inverse_func = JS_DupValue(ctx, fctx->inverse_func);
+    return true;
+}
+
+static bool js_compile_state_functions (sqlite3_context *context, functionjs_context *fctx) {
+    JSContext *ctx = fctx->js_ctx->context;
+    const char *code[] = {fctx->init_code, fctx->step_code, fctx->final_code, fctx->value_code, fctx->inverse_code};
+    JSValue *func[] = {&fctx->init_func, &fctx->step_func, &fctx->final_func, &fctx->value_func, &fctx->inverse_func};
+    const char *err_msg[] = {
+        "JavaScript init code must evaluate to a function in the form (function(){ return initial_state; })",
+        "JavaScript step code must evaluate to a function in the form (function(state, args){ your_code_here })",
+        "JavaScript final code must evaluate to a function in the form (function(state){ your_code_here })",
+        "JavaScript value code must evaluate to a function in the form (function(state){ your_code_here })",
+        "JavaScript inverse code must evaluate to a function in the form (function(state, args){ your_code_here })"
+    };
+    
+    for (int i=0; i<FUNCTION_CODE_COUNT; ++i) {
+        if (!code[i]) continue;
+        
+        JSValue value = js_eval_bytecode(ctx, fctx, i);
+        if (!JS_IsFunction(ctx, value)) {
+            js_error_to_sqlite(context, ctx, value, err_msg[i]);
+            JS_FreeValue(ctx, value);
+            return false;
+        }
+        *func[i] = value;
+    }
+    
+    return true;
+}
+
+static JSValue sqlite_value_to_js (JSContext *ctx, sqlite3_value *value) {
+    int type = sqlite3_value_type(value);
+    
+    switch (type) {
+        case SQLITE_NULL:
+            return JS_NULL;
+            break;
+            
+        case SQLITE_INTEGER:
+            return JS_NewInt64(ctx, sqlite3_value_int64(value));
+            break;
+            
+        case SQLITE_FLOAT:
+            return JS_NewFloat64(ctx, sqlite3_value_double(value));
+            break;
+            
+        case SQLITE_TEXT: {
+            // sqlite3_value_bytes must be called after sqlite3_value_text (the text could be converted to UTF-8)
+            const char *text = (const char *)sqlite3_value_text(value);
+            int size = sqlite3_value_bytes(value);
+            return (text) ? JS_NewStringLen(ctx, text, (size_t)size) : JS_NewStringLen(ctx, "", 0);
+            }
+            break;
+            
+        case SQLITE_BLOB: {
+            int size = sqlite3_value_bytes(value);
+            const void *blob = sqlite3_value_blob(value);
+            return JS_NewArrayBufferCopy(ctx, (const uint8_t *)blob, (size_t)size);
+            }
+            break;
+    }
+    
+    return JS_NULL;
+}
+
+static const char *sqlite_value_text (sqlite3_value *value) {
+    if (sqlite3_value_type(value) != SQLITE_TEXT) return NULL;
+    return (const char *)sqlite3_value_text(value);
+}
+
+static char *sqlite_strdup (const char *str) {
+    if (!str) return NULL;
+    
+    size_t len = strlen(str) + 1;
+    char *result = (char*)sqlite3_malloc((int)len);
+    if (result) memcpy(result, str, len);
+    
+    return result;
+}
+
+static bool js_parse_options (const char *flags, functionjs_options *options, char **err_msg) {
+    // flags is a list of case-insensitive tokens separated by commas, spaces or vertical bars
+    // for example: 'deterministic, innocuous'
+    memset(options, 0, sizeof(functionjs_options));
+    options->pool_size = 0;
+    if (!flags) return true;
+    
+    const char *p = flags;
+    while (*p) {
+        // skip separators
+        while (*p == ',' || *p == '|' || isspace((unsigned char)*p)) ++p;
+        if (*p == 0) break;
+        
+        // isolate token, optionally in the key=value form
+        const char *token = p;
+        while (*p && *p != ',' && *p != '|' && *p != '=' && !isspace((unsigned char)*p)) ++p;
+        size_t len = (size_t)(p - token);
+        
+        const char *value = NULL;
+        size_t value_len = 0;
+        if (*p == '=') {
+            value = ++p;
+            while (*p && *p != ',' && *p != '|' && !isspace((unsigned char)*p)) ++p;
+            value_len = (size_t)(p - value);
+        }
+        
+        #define TOKEN_IS(_s)    ((len == sizeof(_s)-1) && (strncasecmp(token, _s, len) == 0))
+        if (TOKEN_IS("deterministic") && !value) options->func_flags |= SQLITE_DETERMINISTIC;
+        else if (TOKEN_IS("innocuous") && !value) options->func_flags |= SQLITE_INNOCUOUS;
+        else if (TOKEN_IS("directonly") && !value) options->func_flags |= SQLITE_DIRECTONLY;
+        else if (TOKEN_IS("state") && !value) options->state_mode = true;
+        else if (TOKEN_IS("blobview") && !value) options->blob_view = true;
+        else if (TOKEN_IS("bigint") && !value) options->bigint = true;
+        else if (TOKEN_IS("json") && !value) options->json_mode = JSON_MODE_TEXT;
+        else if (TOKEN_IS("jsonb") && !value) options->json_mode = JSON_MODE_BINARY;
+        else if (TOKEN_IS("key") && !value) options->collation_key = true;
+        else if (TOKEN_IS("ascii") && !value) options->ascii_mode = COLLATION_ASCII_BINARY;
+        else if (TOKEN_IS("nocase") && !value) options->ascii_mode = COLLATION_ASCII_NOCASE;
+        else if (TOKEN_IS("abort") && !value) options->collation_abort = true;
+        else if (TOKEN_IS("date")) {
+            // date means all the arguments, date=N only the N-th argument (can be repeated)
+            if (!value) options->date_args = UINT64_MAX;
+            else {
+                char *end = NULL;
+                long index = strtol(value, &end, 10);
+                if (value_len == 0 || end != value + value_len || index < 1 || index > 64) {
+                    if (err_msg) *err_msg = sqlite3_mprintf("Invalid date argument '%.*s'", (int)value_len, value);
+                    return false;
+                }
+                options->date_args |= (1ULL << (index - 1));
+            }
+        }
+        else if (TOKEN_IS("returns") && value) {
+            #define VALUE_IS(_s)    ((value_len == sizeof(_s)-1) && (strncasecmp(value, _s, value_len) == 0))
+            if (VALUE_IS("integer") || VALUE_IS("int")) options->result_type = SQLITE_INTEGER;
+            else if (VALUE_IS("real") || VALUE_IS("float")) options->result_type = SQLITE_FLOAT;
+            else if (VALUE_IS("any")) options->result_type = 0;
+            else {
+                if (err_msg) *err_msg = sqlite3_mprintf("Invalid result type '%.*s'", (int)value_len, value);
+                return false;
+            }
+            #undef VALUE_IS
+        }
+        else if (TOKEN_IS("pool")) {
+            long size = FUNCTION_POOL_DEFAULT_SIZE;
+            if (value) {
+                char *end = NULL;
+                size = strtol(value, &end, 10);
+                if (value_len == 0 || end != value + value_len || size < 0 || size > FUNCTION_POOL_MAX_SIZE) {
+                    if (err_msg) *err_msg = sqlite3_mprintf("Invalid pool size '%.*s'", (int)value_len, value);
+                    return false;
+                }
+            }
+            options->pool_size = (int)size;
+        }
+        else if (TOKEN_IS("cache")) {
+            long size = FUNCTION_CACHE_DEFAULT_SIZE;
+            if (value) {
+                char *end = NULL;
+                size = strtol(value, &end, 10);
+                if (value_len == 0 || end != value + value_len || size < 0 || size > FUNCTION_CACHE_MAX_SIZE) {
+                    if (err_msg) *err_msg = sqlite3_mprintf("Invalid cache size '%.*s'", (int)value_len, value);
+                    return false;
+                }
+            }
+            options->cache_size = (int)size;
+        }
+        else {
+            if (err_msg) *err_msg = sqlite3_mprintf("Unknown function flag '%.*s'", (int)(p - token), token);
+            return false;
+        }
+        #undef TOKEN_IS
+    }
+    
+    return true;
+}
+
+// MARK: - Execution -
+
+static bool functionjs_materialize (sqlite3_context *context, functionjs_context *fctx, const void *bytecode, int bytecode_size, void **blob, int *blob_size) {
+    globaljs_context *js = fctx->js_ctx;
+    bool is_scalar = (strcmp(fctx->kind, FUNCTION_TYPE_SCALAR) == 0);
+    bool is_collation = (strcmp(fctx->kind, FUNCTION_TYPE_COLLATION) == 0);
+    
+    // compile the source code (or reuse the persisted bytecode)
+    const char *code[FUNCTION_CODE_COUNT] = {fctx->init_code, fctx->step_code, fctx->final_code, fctx->value_code, fctx->inverse_code};
+    if (js_compile_bytecode(context, fctx, code, bytecode, bytecode_size) == false) goto abort_materialize;
+    
+    if (is_scalar || is_collation) {
+        // prepare the JavaScript function
+        JSValue func = js_eval_bytecode(js->context, fctx, FUNCTION_CODE_STEP);
+        if (!JS_IsFunction(js->context, func)) {
+            const char *err_msg = (is_scalar) ? ((fctx->nargs == FUNCTION_NARGS_VARIADIC) ? "JavaScript code must evaluate to a function in the form (function(args){ your_code_here })" : "JavaScript code must evaluate to a function in the form (function(arg1, arg2, ...){ your_code_here })") : "JavaScript code must evaluate to a function in the form (function(str1, str2){ your_code_here })";
+            js_error_to_sqlite(context, js->context, func, err_msg);
+            goto abort_materialize;
+        }
+        fctx->func = func;
+    } else if (fctx->options.state_mode) {
+        // compile shared state functions once in the global context
+        if (js_compile_state_functions(context, fctx) == false) goto abort_materialize;
+    } else {
+        // sanity check aggregate code in a separate context
+        if (js_setup_aggregate(context, js, NULL, fctx) == false) goto abort_materialize;
+    }
+    
+    if (blob) {
+        *blob = js_bytecode_pack(fctx->bytecode, fctx->bytecode_size, code, blob_size);
+    }
+    
+    // serialized bytecode is needed later only to create the isolated contexts of aggregate and window functions
+    if (is_scalar || is_collation || fctx->options.state_mode) functionjs_bytecode_free(fctx);
+    
+    if (fctx->lazy_bytecode) sqlite3_free(fctx->lazy_bytecode);
+    fctx->lazy_bytecode = NULL;
+    fctx->lazy_bytecode_size = 0;
+    fctx->materialized = true;
+    return true;
+    
+abort_materialize:
+    functionjs_compiled_free(fctx);
+    return false;
+}
+
+static JSValue sqlite_value_to_js_arg (JSContext *ctx, sqlite3_value *value, JSValue *view, const functionjs_options *options, int index) {
+    if (options && index < 64 && (options->date_args & (1ULL << index))) return sqlite_value_to_js_date(ctx, value);
+    if (options && options->json_mode) return sqlite_value_to_js_json(ctx, value);
+    
+    // with bigint set an INTEGER argument outside the safe integer range is a BigInt instead of a rounded number
+    if (options && options->bigint && sqlite3_value_type(value) == SQLITE_INTEGER) {
+        sqlite3_int64 n = sqlite3_value_int64(value);
+        if (n > MAX_SAFE_INTEGER || n < -MAX_SAFE_INTEGER) return JS_NewBigInt64(ctx, (int64_t)n);
+    }
+    
+    // with views enabled a BLOB argument is an ArrayBuffer that points directly to the SQLite memory,
+    // it must be detached (with js_release_views) as soon as the call returns because the memory is not owned
+    if (!view) return sqlite_value_to_js(ctx, value);
+    
+    *view = JS_UNDEFINED;
+    int size = sqlite3_value_bytes(value);
+    if (sqlite3_value_type(value) != SQLITE_BLOB || size == 0) return sqlite_value_to_js(ctx, value);
+    
+    JSValue buffer = JS_NewArrayBuffer(ctx, (uint8_t *)sqlite3_value_blob(value), (size_t)size, NULL, NULL, false);
+    if (!JS_IsException(buffer)) *view = JS_DupValue(ctx, buffer);
+    return buffer;
+}
+
+static void js_release_views (JSContext *ctx, int nvalues, JSValue *views) {
+    if (!views) return;
+    for (int i=0; i<nvalues; ++i) {
+        if (JS_IsUndefined(views[i])) continue;
+        JS_DetachArrayBuffer(ctx, views[i]);
+        JS_FreeValue(ctx, views[i]);
+    }
+}
+
+static JSValue js_call_positional (JSContext *js_context, int nvalues, sqlite3_value **values, JSValue *views, const functionjs_options *options, JSValue func, JSValue this_obj) {
+    // pass each SQLite value as a separate JS parameter, without any intermediate array
+    JSValue stack_args[FUNCTION_STACK_ARGS];
+    JSValue *args = stack_args;
+    if (nvalues > FUNCTION_STACK_ARGS) {
+        args = (JSValue *)sqlite3_malloc((int)(sizeof(JSValue) * nvalues));
+        if (!args) return JS_ThrowOutOfMemory(js_context);
+    }
+    
+    for (int i=0; i<nvalues; ++i) {
+        args[i] = sqlite_value_to_js_arg(js_context, values[i], (views) ? &views[i] : NULL, options, i);
+    }
+    
+    JSValue result = JS_Call(js_context, func, this_obj, nvalues, (JSValueConst *)args);
+    for (int i=0; i<nvalues; ++i) {
+        JS_FreeValue(js_context, args[i]);
+    }
+    if (args != stack_args) sqlite3_free(args);
+    
+    return result;
+}
+
+static JSValue js_call_common (JSContext *js_context, int nvalues, sqlite3_value **values, JSValue *views, const functionjs_options *options, JSValue func, JSValue this_obj) {
+    // create JS array for arguments
+    JSValue args = (values) ? JS_NewArray(js_context) : JS_NULL;
+    for (int i=0; i<nvalues; ++i) {
+        JSValue js_val = sqlite_value_to_js_arg(js_context, values[i], (views) ? &views[i] : NULL, options, i);
+        JS_SetPropertyUint32(js_context, args, i, js_val);
+    }
+    
+    // call the JavaScript function with args_array as the argument
+    JSValueConst args_val[] = {args};
+    JSValue result = JS_Call(js_context, func, this_obj, (values) ? 1 : 0, (values) ? args_val : NULL);
+    JS_FreeValue(js_context, args);
     
-    JS_FreeContext(ctx);
     return result;
 }
 
-static JSValue sqlite_value_to_js (JSContext *ctx, sqlite3_value *value) {
-    int type = sqlite3_value_type(value);
-    
-    switch (type) {
-        case SQLITE_NULL:
-            return JS_NULL;
+static void js_execute_common (sqlite3_context *context, JSContext *js_context, int nvalues, sqlite3_value **values, const functionjs_options *options, JSValue func, JSValue this_obj, bool return_value) {
+    JSValue result = js_call_common(js_context, nvalues, values, NULL, options, func, this_obj);
+    if (return_value) js_value_to_sqlite_typed(context, js_context, result, options);
+    JS_FreeValue(js_context, result);
+}
+
+static void js_cache_value_to_sqlite (sqlite3_context *context, JSContext *js_context, jscache *cache, JSValue value, const functionjs_options *options) {
+    // only primitive results are cached, everything else goes through the generic conversion
+    jscache_entry *entry = NULL;
+    int tag = JS_VALUE_GET_NORM_TAG(value);
+    
+    switch (tag) {
+        case JS_TAG_NULL:
+        case JS_TAG_UNDEFINED:
+            entry = jscache_insert(cache, SQLITE_NULL, 0, 0.0, NULL, 0);
             break;
             
-        case SQLITE_INTEGER:
-            return JS_NewInt64(ctx, sqlite3_value_int64(value));
-            break;
+        case JS_TAG_INT:
+        case JS_TAG_FLOAT64: {
+            sqlite3_int64 n = 0;
+            double d = 0.0;
+            int type = js_number_to_sqlite(value, options, &n, &d);
+            entry = jscache_insert(cache, type, n, d, NULL, 0);
+        } break;
             
-        case SQLITE_FLOAT:
-            return JS_NewFloat64(ctx, sqlite3_value_double(value));
+        case JS_TAG_BOOL:
+            entry = jscache_insert(cache, SQLITE_INTEGER, JS_VALUE_GET_BOOL(value), 0.0, NULL, 0);
             break;
             
-        case SQLITE_TEXT:
-            return JS_NewString(ctx, (const char *)sqlite3_value_text(value));
-            break;
+        case JS_TAG_BIG_INT: {
+            sqlite3_int64 n;
+            if (js_bigint_to_int64(js_context, value, &n)) entry = jscache_insert(cache, SQLITE_INTEGER, n, 0.0, NULL, 0);
+        } break;
             
-        case SQLITE_BLOB: {
-            int size = sqlite3_value_bytes(value);
-            const void *blob = sqlite3_value_blob(value);
-            return JS_NewArrayBufferCopy(ctx, (const uint8_t *)blob, (size_t)size);
+        case JS_TAG_STRING: {
+            size_t len = 0;
+            const char *str = JS_ToCStringLen(js_context, &len, value);
+            if (str) {
+                entry = jscache_insert(cache, SQLITE_TEXT, 0, 0.0, str, (int)len);
+                JS_FreeCString(js_context, str);
             }
-            break;
+        } break;
     }
     
-    return JS_NULL;
-}
-
-static const char *sqlite_value_text (sqlite3_value *value) {
-    if (sqlite3_value_type(value) != SQLITE_TEXT) return NULL;
-    return (const char *)sqlite3_value_text(value);
+    if (entry) jscache_result(context, entry);
+    else js_value_to_sqlite_typed(context, js_context, value, options);
 }
 
-static char *sqlite_strdup (const char *str) {
-    if (!str) return NULL;
+static void js_execute_scalar (sqlite3_context *context, int nvalues, sqlite3_value **values) {
+    functionjs_context *fctx = (functionjs_context *)sqlite3_user_data(context);
+    JSContext *js_context = fctx->js_ctx->context;
+    if (!fctx->materialized && !functionjs_materialize(context, fctx, fctx->lazy_bytecode, fctx->lazy_bytecode_size, NULL, NULL)) return;
+    
+    // lookup arguments in the result cache (if enabled)
+    jscache *cache = fctx->cache;
+    jscache_saved_key saved_key;
+    if (cache) {
+        if (jscache_key_values(cache, nvalues, values)) {
+            jscache_entry *entry = jscache_lookup(cache);
+            if (entry) {
+                jscache_result(context, entry);
+                return;
+            }
+            if (!jscache_key_save(cache, &saved_key)) cache = NULL;
+        } else {
+            // unable to serialize the key, just skip the cache for this call
+            cache = NULL;
+        }
+    }
     
-    size_t len = strlen(str) + 1;
-    char *result = (char*)sqlite3_malloc((int)len);
-    if (result) memcpy(result, str, len);
+    // BLOB views must stay valid until the result has been converted (it could be one of the arguments),
+    // without trusted_blobview the flag is ignored and the arguments are copied as usual
+    JSValue stack_views[FUNCTION_STACK_ARGS];
+    JSValue *views = NULL;
+    if (fctx->options.blob_view && fctx->js_ctx->trusted_blobview && nvalues > 0) {
+        views = (nvalues > FUNCTION_STACK_ARGS) ? (JSValue *)sqlite3_malloc((int)(sizeof(JSValue) * nvalues)) : stack_views;
+        if (!views) {
+            sqlite3_result_error_nomem(context);
+            return;
+        }
+        for (int i=0; i<nvalues; ++i) views[i] = JS_UNDEFINED;
+    }
     
-    return result;
+    JSValue result;
+    if (fctx->nargs == FUNCTION_NARGS_VARIADIC) result = js_call_common(js_context, nvalues, values, views, &fctx->options, fctx->func, JS_UNDEFINED);
+    else result = js_call_positional(js_context, nvalues, values, views, &fctx->options, fctx->func, JS_UNDEFINED);
+    
+    if (cache) jscache_key_restore(cache, &saved_key);
+    if (cache && !JS_IsException(result)) js_cache_value_to_sqlite(context, js_context, cache, result, &fctx->options);
+    else js_value_to_sqlite_typed(context, js_context, result, &fctx->options);
+    JS_FreeValue(js_context, result);
+    
+    js_release_views(js_context, nvalues, views);
+    if (views && views != stack_views) sqlite3_free(views);
 }
 
-// MARK: - Execution -
-
-static void js_execute_common (sqlite3_context *context, JSContext *js_context, int nvalues, sqlite3_value **values, JSValue func, JSValue this_obj, bool return_value) {
-    // create JS array for arguments
+static JSValue js_call_state (JSContext *js_context, int nvalues, sqlite3_value **values, const functionjs_options *options, JSValue func, JSValue state) {
+    // state mode: the per-group state object is always the first parameter, followed by the args array (if any)
     JSValue args = (values) ? JS_NewArray(js_context) : JS_NULL;
     for (int i=0; i<nvalues; ++i) {
-        JSValue js_val = sqlite_value_to_js(js_context, values[i]);
+        JSValue js_val = sqlite_value_to_js_arg(js_context, values[i], NULL, options, i);
         JS_SetPropertyUint32(js_context, args, i, js_val);
     }
     
-    // call the JavaScript function with args_array as the argument
-    JSValueConst args_val[] = {args};
-    JSValue result = JS_Call(js_context, func, this_obj, (values) ? 1 : 0, (values) ? args_val : NULL);
+    JSValueConst args_val[] = {state, args};
+    JSValue result = JS_Call(js_context, func, JS_UNDEFINED, (values) ? 2 : 1, args_val);
     JS_FreeValue(js_context, args);
     
-    if (return_value) js_value_to_sqlite(context, js_context, result);
-    JS_FreeValue(js_context, result);
+    return result;
 }
 
-static void js_execute_scalar (sqlite3_context *context, int nvalues, sqlite3_value **values) {
+static void js_execute_aggregate (sqlite3_context *context, functionjs_aggregate_context *agg_ctx, int nvalues, sqlite3_value **values, JSValue func, bool return_value) {
     functionjs_context *fctx = (functionjs_context *)sqlite3_user_data(context);
-    js_execute_common(context, fctx->js_ctx->context, nvalues, values, fctx->func, JS_UNDEFINED, true);
+    const functionjs_options *options = (fctx) ? &fctx->options : NULL;
+    if (JS_IsNull(agg_ctx->state)) {
+        js_execute_common(context, agg_ctx->context, nvalues, values, options, func, JS_UNDEFINED, return_value);
+        return;
+    }
+    
+    JSValue result = js_call_state(agg_ctx->context, nvalues, values, options, func, agg_ctx->state);
+    if (return_value || JS_IsException(result)) js_value_to_sqlite_typed(context, agg_ctx->context, result, options);
+    JS_FreeValue(agg_ctx->context, result);
 }
 
-static void js_execute_step (sqlite3_context *context, int nvalues, sqlite3_value **values) {
+static bool js_setup_pooled (functionjs_context *fctx, functionjs_aggregate_context *agg_ctx) {
+    // reuse a recycled isolated context (if any), init code and functions are evaluated again as in a new context
+    while (fctx->pool) {
+        jspool_entry *entry = fctx->pool;
+        fctx->pool = entry->next;
+        fctx->pool_count--;
+        
+        agg_ctx->state = JS_NULL;
+        agg_ctx->step_func = JS_NULL;
+        agg_ctx->final_func = JS_NULL;
+        agg_ctx->value_func = JS_NULL;
+        agg_ctx->inverse_func = JS_NULL;
+        
+        bool is_error = false;
+        if (fctx->bytecode[FUNCTION_CODE_INIT]) {
+            JSValue result = js_eval_bytecode(entry->context, fctx, FUNCTION_CODE_INIT);
+            is_error = JS_IsException(result);
+            JS_FreeValue(entry->context, result);
+        }
+        if (!is_error) is_error = !js_eval_aggregate_functions(NULL, entry->context, fctx, agg_ctx);
+        if (is_error) {
+            // init code cannot be executed twice in the same context (for example because of let/const declarations)
+            // so discard the pooled context, fall back to a fresh one and disable the pool (reported by js_stats)
+            JSValue exception = JS_GetException(entry->context);
+            const char *err_msg = NULL;
+            if (JS_IsObject(exception)) {
+                JSValue message = JS_GetPropertyStr(entry->context, exception, "message");
+                if (!JS_IsException(message) && JS_IsString(message)) err_msg = JS_ToCString(entry->context, message);
+                JS_FreeValue(entry->context, message);
+            }
+            if (fctx->last_error) sqlite3_free(fctx->last_error);
+            fctx->last_error = sqlite3_mprintf("pool disabled, the init code cannot be executed again in a recycled context: %s", (err_msg) ? err_msg : "Unknown JavaScript exception");
+            sqlite3_log(SQLITE_WARNING, "js function %s: %s", fctx->name, (fctx->last_error) ? fctx->last_error : "pool disabled");
+            fctx->errors++;
+            if (err_msg) JS_FreeCString(entry->context, err_msg);
+            JS_FreeValue(entry->context, exception);
+            jspool_entry_free(entry);
+            fctx->options.pool_size = 0;
+            continue;
+        }
+        
+        agg_ctx->context = entry->context;
+        agg_ctx->owns_context = true;
+        sqlite3_free(entry);
+        
+        fctx->pool_hits++;
+        return true;
+    }
+    
+    if (fctx->options.pool_size > 0) fctx->pool_misses++;
+    return false;
+}
+
+static bool js_execute_setup (sqlite3_context *context, functionjs_aggregate_context *agg_ctx) {
+    if (agg_ctx->context) return true;
+    
     functionjs_context *fctx = (functionjs_context *)sqlite3_user_data(context);
-    globaljs_context *js = fctx->js_ctx;
-    functionjs_aggregate_context *agg_ctx = sqlite3_aggregate_context(context, sizeof(*agg_ctx));
+    if (!fctx->materialized && !functionjs_materialize(context, fctx, fctx->lazy_bytecode, fctx->lazy_bytecode_size, NULL, NULL)) return false;
+    if (fctx->options.state_mode) return js_setup_state(context, fctx, agg_ctx);
+    if (js_setup_pooled(fctx, agg_ctx)) return true;
     
     // if there is an init code then create a separate aggregate context
     // to avoid shared state corruption across parallel aggregates
-    if (!agg_ctx->context) {
-        // set up a new isolated environment for this aggregation
-        if (js_setup_aggregate(context, js, agg_ctx, fctx->init_code, fctx->step_code, fctx->final_code, fctx->value_code, fctx->inverse_code) == false) return;
-    }
+    return js_setup_aggregate(context, fctx->js_ctx, agg_ctx, fctx);
+}
 
-    js_execute_common(context, agg_ctx->context, nvalues, values, agg_ctx->step_func, JS_UNDEFINED, false);
+static void js_execute_step (sqlite3_context *context, int nvalues, sqlite3_value **values) {
+    functionjs_aggregate_context *agg_ctx = sqlite3_aggregate_context(context, sizeof(*agg_ctx));
+    if (!agg_ctx) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    
+    // set up the environment for this aggregation (if needed)
+    if (js_execute_setup(context, agg_ctx) == false) return;
+    
+    js_execute_aggregate(context, agg_ctx, nvalues, values, agg_ctx->step_func, false);
 }
 
 static void js_execute_value (sqlite3_context *context) {
     functionjs_aggregate_context *agg_ctx = sqlite3_aggregate_context(context, sizeof(*agg_ctx));
-    js_execute_common(context, agg_ctx->context, 0, NULL, agg_ctx->value_func, JS_UNDEFINED, true);
+    if (!agg_ctx || js_execute_setup(context, agg_ctx) == false) return;
+    
+    js_execute_aggregate(context, agg_ctx, 0, NULL, agg_ctx->value_func, true);
 }
 
 static void js_execute_inverse (sqlite3_context *context, int nvalues, sqlite3_value **values) {
     functionjs_aggregate_context *agg_ctx = sqlite3_aggregate_context(context, sizeof(*agg_ctx));
-    js_execute_common(context, agg_ctx->context, nvalues, values, agg_ctx->inverse_func, JS_UNDEFINED, false);
+    if (!agg_ctx || js_execute_setup(context, agg_ctx) == false) return;
+    
+    js_execute_aggregate(context, agg_ctx, nvalues, values, agg_ctx->inverse_func, false);
 }
 
 static void js_execute_final (sqlite3_context *context) {
     functionjs_aggregate_context *agg_ctx = sqlite3_aggregate_context(context, sizeof(*agg_ctx));
+    
+    // final can be called without any previous step (empty groups)
+    if (!agg_ctx || js_execute_setup(context, agg_ctx) == false) return;
+    
+    js_execute_aggregate(context, agg_ctx, 0, NULL, agg_ctx->final_func, true);
+    functionjs_aggregate_free((functionjs_context *)sqlite3_user_data(context), agg_ctx);
+}
 
-    js_execute_common(context, agg_ctx->context, 0, NULL, agg_ctx->final_func, JS_UNDEFINED, true);
-    functionjs_aggregate_free(agg_ctx);
+static int js_collation_binary (int len1, const void *v1, int len2, const void *v2) {
+    int n = (len1 < len2) ? len1 : len2;
+    int rc = (n == 0) ? 0 : memcmp(v1, v2, (size_t)n);
+    return (rc) ? rc : len1 - len2;
+}
+
+static bool js_is_ascii (const unsigned char *s, int len) {
+    // 8 bytes at a time, a byte with the high bit set ends the ASCII run
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t chunk;
+        memcpy(&chunk, s + i, sizeof(chunk));
+        if (chunk & 0x8080808080808080ULL) return false;
+    }
+    for (; i < len; ++i) {
+        if (s[i] & 0x80) return false;
+    }
+    return true;
+}
+
+static bool js_collation_ascii (int mode, int len1, const void *v1, int len2, const void *v2, int *result) {
+    // a collation declared ascii (or nocase) orders two ASCII strings like BINARY (or NOCASE), the order
+    // of strings with any non-ASCII character is known only to the JS function
+    if (!js_is_ascii((const unsigned char *)v1, len1) || !js_is_ascii((const unsigned char *)v2, len2)) return false;
+    
+    if (mode == COLLATION_ASCII_BINARY) {
+        *result = js_collation_binary(len1, v1, len2, v2);
+        return true;
+    }
+    
+    int n = (len1 < len2) ? len1 : len2;
+    int rc = (n == 0) ? 0 : sqlite3_strnicmp((const char *)v1, (const char *)v2, n);
+    *result = (rc) ? rc : len1 - len2;
+    return true;
+}
+
+static int js_collation_error (functionjs_context *fctx, const char *default_error, int len1, const void *v1, int len2, const void *v2) {
+    // a collation cannot return an error, the failed comparison uses the binary order instead (so the same pair always
+    // compares the same way) and the error is logged and counted by js_stats; inside js_step the error is also left in
+    // pending_error and thrown to JS when the step returns, and only collations declared with abort interrupt the
+    // statements running on the connection (they fail with SQLITE_INTERRUPT)
+    globaljs_context *js = fctx->js_ctx;
+    const char *err_msg = NULL;
+    JSValue exception = JS_NULL;
+    
+    if (!default_error) {
+        exception = JS_GetException(js->context);
+        if (JS_IsObject(exception)) {
+            JSValue message = JS_GetPropertyStr(js->context, exception, "message");
+            if (!JS_IsException(message) && JS_IsString(message)) err_msg = JS_ToCString(js->context, message);
+            JS_FreeValue(js->context, message);
+        }
+    }
+    
+    if (fctx->last_error) sqlite3_free(fctx->last_error);
+    fctx->last_error = sqlite3_mprintf("%s", (err_msg) ? err_msg : (default_error) ? default_error : "Unknown JavaScript exception");
+    sqlite3_log(SQLITE_ERROR, "js collation %s: %s", fctx->name, (fctx->last_error) ? fctx->last_error : "error");
+    fctx->errors++;
+    if (js->step_depth == 0) {
+        if (fctx->options.collation_abort) sqlite3_interrupt(js->db);
+    } else if (!js->pending_error) js->pending_error = sqlite3_mprintf("%s", (fctx->last_error) ? fctx->last_error : "Unknown JavaScript exception");
+    
+    if (err_msg) JS_FreeCString(js->context, err_msg);
+    JS_FreeValue(js->context, exception);
+    return js_collation_binary(len1, v1, len2, v2);
 }
 
 static int js_execute_collation (void *xdata, int len1, const void *v1, int len2, const void *v2) {
     functionjs_context *fctx = (functionjs_context *)xdata;
     globaljs_context *js = fctx->js_ctx;
+    
+    int nresult = 0;
+    if (fctx->options.ascii_mode && js_collation_ascii(fctx->options.ascii_mode, len1, v1, len2, v2, &nresult)) return nresult;
+    
+    // the statement already failed, the remaining comparisons only have to be consistent
+    if (js->pending_error) return js_collation_binary(len1, v1, len2, v2);
 
     // create arguments
     JSValue val1 = (v1) ? JS_NewStringLen(js->context, (const char *)v1, (size_t)len1) : JS_NULL;
@@ -746,12 +3803,93 @@ static int js_execute_collation (void *xdata, int len1, const void *v1, int len2
     JS_FreeValue(js->context, val1);
     JS_FreeValue(js->context, val2);
     
-    // default result if JS result is not a number
-    int nresult = -1;
-    if (JS_IsNumber(result)) JS_ToInt32(js->context, &nresult, result);
+    // small integers are read directly from the value, only the sign of other numbers matters (NaN means equal
+    // like in Array.prototype.sort), anything else is an error instead of an arbitrary unstable order
+    switch (JS_VALUE_GET_NORM_TAG(result)) {
+        case JS_TAG_INT:
+            return JS_VALUE_GET_INT(result);
+            
+        case JS_TAG_FLOAT64: {
+            double d = JS_VALUE_GET_FLOAT64(result);
+            return (d < 0) ? -1 : (d > 0) ? 1 : 0;
+        }
+            
+        case JS_TAG_EXCEPTION:
+            return js_collation_error(fctx, NULL, len1, v1, len2, v2);
+    }
+    
     JS_FreeValue(js->context, result);
+    return js_collation_error(fctx, "The collation function must return a number", len1, v1, len2, v2);
+}
+
+static jscache_entry *js_collation_key (functionjs_context *fctx, int len, const void *v) {
+    // the sort key of a string is computed by JS only the first time the string is seen (while it stays in the cache)
+    jscache *cache = fctx->cache;
+    cache->nkey = 0;
+    if (!jscache_key_append(cache, SQLITE_TEXT, v, len)) return NULL;
+    jscache_key_hash(cache);
+    
+    jscache_entry *entry = jscache_lookup(cache);
+    if (entry) return entry;
+    
+    JSContext *ctx = fctx->js_ctx->context;
+    JSValue arg = JS_NewStringLen(ctx, (v) ? (const char *)v : "", (size_t)len);
+    JSValue result = JS_Call(ctx, fctx->func, JS_UNDEFINED, 1, &arg);
+    JS_FreeValue(ctx, arg);
+    
+    // numbers are stored as REAL, strings and binary data as bytes
+    switch (JS_VALUE_GET_NORM_TAG(result)) {
+        case JS_TAG_INT:
+        case JS_TAG_FLOAT64: {
+            double d = 0;
+            JS_ToFloat64(ctx, &d, result);
+            entry = jscache_insert(cache, SQLITE_FLOAT, 0, d, NULL, 0);
+        } break;
+            
+        case JS_TAG_STRING: {
+            size_t size = 0;
+            const char *str = JS_ToCStringLen(ctx, &size, result);
+            if (str) {
+                entry = jscache_insert(cache, SQLITE_TEXT, 0, 0.0, str, (int)size);
+                JS_FreeCString(ctx, str);
+            }
+        } break;
+            
+        case JS_TAG_OBJECT: {
+            const uint8_t *buffer = NULL;
+            size_t size = 0;
+            if (js_binary_data(ctx, result, &buffer, &size) > 0) entry = jscache_insert(cache, SQLITE_BLOB, 0, 0.0, buffer, (int)size);
+        } break;
+            
+        case JS_TAG_EXCEPTION:
+            return NULL;
+    }
+    
+    JS_FreeValue(ctx, result);
+    if (!entry) JS_ThrowTypeError(ctx, "The collation key must be a number, a string or binary data");
+    return entry;
+}
+
+static int js_execute_collation_key (void *xdata, int len1, const void *v1, int len2, const void *v2) {
+    // numeric keys sort before byte keys, byte keys (strings as UTF-8) are compared with memcmp
+    functionjs_context *fctx = (functionjs_context *)xdata;
+    if (len1 == len2 && (len1 == 0 || memcmp(v1, v2, (size_t)len1) == 0)) return 0;
     
-    return nresult;
+    int result = 0;
+    if (fctx->options.ascii_mode && js_collation_ascii(fctx->options.ascii_mode, len1, v1, len2, v2, &result)) return result;
+    
+    jscache_entry *key1 = js_collation_key(fctx, len1, v1);
+    jscache_entry *key2 = (key1) ? js_collation_key(fctx, len2, v2) : NULL;
+    if (!key1 || !key2) return js_collation_error(fctx, NULL, len1, v1, len2, v2);
+    
+    bool num1 = (key1->type == SQLITE_FLOAT);
+    bool num2 = (key2->type == SQLITE_FLOAT);
+    if (num1 && num2) return (key1->dvalue < key2->dvalue) ? -1 : (key1->dvalue > key2->dvalue) ? 1 : 0;
+    if (num1 != num2) return (num1) ? -1 : 1;
+    
+    int n1 = key1->nvalue, n2 = key2->nvalue;
+    int rc = memcmp(key1->data + key1->nkey, key2->data + key2->nkey, (size_t)((n1 < n2) ? n1 : n2));
+    return (rc) ? rc : (n1 < n2) ? -1 : (n1 > n2) ? 1 : 0;
 }
 
 static void js_execute_cleanup (void *xdata) {
@@ -774,7 +3912,7 @@ void js_version0 (sqlite3_context *context, int argc, sqlite3_value **argv) {
     js_version(context, false);
 }
 
-bool js_add_to_table (sqlite3_context *context, const char *type, const char *name, const char *init_code, const char *step_code, const char *final_code, const char *value_code, const char *inverse_code) {
+bool js_add_to_table (sqlite3_context *context, const char *type, const char *name, const char *init_code, const char *step_code, const char *final_code, const char *value_code, const char *inverse_code, int nargs, const char *flags, const void *bytecode, int bytecode_size, const char *bytecode_tag) {
     
     // add function to table under the following conditions:
     // 1. js_functions table exists
@@ -784,7 +3922,7 @@ bool js_add_to_table (sqlite3_context *context, const char *type, const char *na
     sqlite3_stmt *vm = NULL;
     
     // query table first
-    const char *sql = "SELECT kind,init_code,step_code,final_code,value_code,inverse_code FROM js_functions WHERE name=?1 LIMIT 1;";
+    const char *sql = "SELECT kind,init_code,step_code,final_code,value_code,inverse_code,nargs,flags,bytecode_tag,bytecode IS NULL FROM js_functions WHERE name=?1 LIMIT 1;";
     int rc = sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
     if (rc != SQLITE_OK) {
         // table js_functions does not exist
@@ -809,13 +3947,22 @@ bool js_add_to_table (sqlite3_context *context, const char *type, const char *na
     const char *final_code2 = (sqlite3_column_type(vm, 3) == SQLITE_NULL) ? NULL : (const char *)sqlite3_column_text(vm, 3);
     const char *value_code2 = (sqlite3_column_type(vm, 4) == SQLITE_NULL) ? NULL : (const char *)sqlite3_column_text(vm, 4);
     const char *inverse_code2 = (sqlite3_column_type(vm, 5) == SQLITE_NULL) ? NULL : (const char *)sqlite3_column_text(vm, 5);
+    int nargs2 = (sqlite3_column_type(vm, 6) == SQLITE_NULL) ? FUNCTION_NARGS_VARIADIC : sqlite3_column_int(vm, 6);
+    const char *flags2 = (sqlite3_column_type(vm, 7) == SQLITE_NULL) ? NULL : (const char *)sqlite3_column_text(vm, 7);
+    const char *bytecode_tag2 = (sqlite3_column_type(vm, 8) == SQLITE_NULL) ? NULL : (const char *)sqlite3_column_text(vm, 8);
+    bool bytecode_null2 = (sqlite3_column_int(vm, 9) != 0);
     
     if ((strcasecmp(type, type2) != 0) ||
+        (nargs != nargs2) ||
         SAFE_STRCMP(init_code, init_code2) ||
         SAFE_STRCMP(step_code, step_code2) ||
         SAFE_STRCMP(final_code, final_code2) ||
         SAFE_STRCMP(value_code, value_code2) ||
-        SAFE_STRCMP(inverse_code, inverse_code2)) force_reinsert = true;
+        SAFE_STRCMP(inverse_code, inverse_code2) ||
+        SAFE_STRCMP(flags, flags2)) force_reinsert = true;
+    
+    // refresh stale bytecode (for example compiled by a different QuickJS version)
+    if (bytecode && (bytecode_null2 || SAFE_STRCMP(bytecode_tag, bytecode_tag2))) force_reinsert = true;
     
     // the following logic:
     // if ((init_code == NULL) && (init_code2 != NULL)) force_reinsert = true;
@@ -832,7 +3979,7 @@ insert_function:
     sqlite3_finalize(vm);
     if (force_reinsert == false) return true;
     
-    sql = "REPLACE INTO js_functions (name, kind, init_code, step_code, final_code, value_code, inverse_code) VALUES (?, ?, ?, ?, ?, ?, ?);";
+    sql = "REPLACE INTO js_functions (name, kind, init_code, step_code, final_code, value_code, inverse_code, nargs, flags, bytecode, bytecode_tag) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
     rc = sqlite3_prepare(db, sql, -1, &vm, NULL);
     if (rc == SQLITE_OK) {
         rc = sqlite3_bind_text(vm, 1, name, -1, NULL);
@@ -842,6 +3989,10 @@ insert_function:
         rc = (final_code == NULL) ? sqlite3_bind_null(vm, 5) : sqlite3_bind_text(vm, 5, final_code, -1, NULL);
         rc = (value_code == NULL) ? sqlite3_bind_null(vm, 6) : sqlite3_bind_text(vm, 6, value_code, -1, NULL);
         rc = (inverse_code == NULL) ? sqlite3_bind_null(vm, 7) : sqlite3_bind_text(vm, 7, inverse_code, -1, NULL);
+        rc = sqlite3_bind_int(vm, 8, nargs);
+        rc = (flags == NULL) ? sqlite3_bind_null(vm, 9) : sqlite3_bind_text(vm, 9, flags, -1, NULL);
+        rc = (bytecode == NULL) ? sqlite3_bind_null(vm, 10) : sqlite3_bind_blob(vm, 10, bytecode, bytecode_size, NULL);
+        rc = (bytecode == NULL) ? sqlite3_bind_null(vm, 11) : sqlite3_bind_text(vm, 11, bytecode_tag, -1, NULL);
     }
     
     rc = sqlite3_step(vm);
@@ -850,45 +4001,105 @@ insert_function:
     return (rc == SQLITE_DONE);
 }
 
-bool js_create_common (sqlite3_context *context, const char *type, const char *name, const char *init_code, const char *step_code, const char *final_code, const char *value_code, const char *inverse_code, bool is_load) {
+bool js_create_common (sqlite3_context *context, const char *type, const char *name, const char *init_code, const char *step_code, const char *final_code, const char *value_code, const char *inverse_code, int nargs, const char *flags, const void *bytecode, int bytecode_size, bool is_load, bool is_lazy) {
     
     globaljs_context *js = (globaljs_context *)sqlite3_user_data(context);
     
+    // parse function flags
+    functionjs_options options;
+    char *err_msg = NULL;
+    if (js_parse_options(flags, &options, &err_msg) == false) {
+        sqlite3_result_error(context, (err_msg) ? err_msg : "Unable to parse function flags", -1);
+        if (err_msg) sqlite3_free(err_msg);
+        return false;
+    }
+    
     bool is_scalar = (strcasecmp(type, FUNCTION_TYPE_SCALAR) == 0);
     bool is_aggregate = (is_scalar) ? false : (strcasecmp(type, FUNCTION_TYPE_AGGREGATE) == 0);
     bool is_window = (is_aggregate) ? false : (strcasecmp(type, FUNCTION_TYPE_WINDOW) == 0);
     bool is_collation = (is_window) ? false : (strcasecmp(type, FUNCTION_TYPE_COLLATION) == 0);
     bool step_code_null = (is_scalar || is_collation);
     
-    if (is_aggregate || is_window) {
-        // sanity check aggregate code
-        if (js_setup_aggregate(context, js, NULL, init_code, step_code, final_code, NULL, NULL) == false) return false;
+    // only scalar functions can be registered with a fixed number of arguments or with a result cache
+    // (key collations always use the cache to store the sort keys)
+    if (!is_scalar) nargs = FUNCTION_NARGS_VARIADIC;
+    if (!is_collation && options.collation_key) {
+        sqlite3_result_error(context, "The key flag is supported only by collations", -1);
+        return false;
     }
+    if (!is_collation && options.collation_abort) {
+        sqlite3_result_error(context, "The abort flag is supported only by collations", -1);
+        return false;
+    }
+    if (!is_collation && options.ascii_mode) {
+        sqlite3_result_error(context, "The ascii and nocase flags are supported only by collations", -1);
+        return false;
+    }
+    if (!is_scalar && !options.collation_key && options.cache_size > 0) {
+        sqlite3_result_error(context, "The cache flag is supported only by scalar functions", -1);
+        return false;
+    }
+    if (is_scalar && options.cache_size > 0 && !(options.func_flags & SQLITE_DETERMINISTIC)) {
+        sqlite3_result_error(context, "The cache flag requires the deterministic flag", -1);
+        return false;
+    }
+    if (options.collation_key) {
+        // two keys must fit in the cache at the same time
+        if (options.cache_size == 0) options.cache_size = COLLATION_KEY_CACHE_DEFAULT_SIZE;
+        if (options.cache_size < 2) options.cache_size = 2;
+    }
+    if (!is_scalar && options.blob_view) {
+        sqlite3_result_error(context, "The blobview flag is supported only by scalar functions", -1);
+        return false;
+    }
+    if (!is_aggregate && !is_window && options.state_mode) {
+        sqlite3_result_error(context, "The state flag is supported only by aggregate and window functions", -1);
+        return false;
+    }
+    
+    if (!(is_aggregate || is_window) || options.state_mode) options.pool_size = 0;
+    
+    // collations cannot report errors at call time, so they are always compiled immediately
+    if (is_collation) is_lazy = false;
     
     // create function context
-    functionjs_context *fctx = functionjs_init(js, init_code, (step_code_null) ? NULL : step_code, final_code, value_code, inverse_code);
+    const char *kind = (is_scalar) ? FUNCTION_TYPE_SCALAR : (is_aggregate) ? FUNCTION_TYPE_AGGREGATE : (is_window) ? FUNCTION_TYPE_WINDOW : FUNCTION_TYPE_COLLATION;
+    functionjs_context *fctx = functionjs_init(js, kind, name, (step_code_null) ? NULL : init_code, step_code, (step_code_null) ? NULL : final_code, (step_code_null) ? NULL : value_code, (step_code_null) ? NULL : inverse_code, nargs, &options);
     if (!fctx) {
         sqlite3_result_error_nomem(context);
         return false;
     }
     
-    if (is_scalar || is_collation) {
-        // prepare the JavaScript function
-        JSValue func = JS_Eval(js->context, step_code, strlen(step_code), NULL, JS_EVAL_TYPE_GLOBAL);
-        if (!JS_IsFunction(js->context, func)) {
-            const char *err_msg = (is_scalar) ? "JavaScript code must evaluate to a function in the form (function(args){ your_code_here })" : "JavaScript code must evaluate to a function in the form (function(str1, str2){ your_code_here })";
-            js_error_to_sqlite(context, js->context, func, err_msg);
-            functionjs_free(fctx);
-            return false;
+    // serialized bytecode to persist in the js_functions table
+    void *blob = NULL;
+    int blob_size = 0;
+    
+    if (is_lazy) {
+        // keep a copy of the persisted bytecode, code is compiled on the first call
+        if (bytecode && bytecode_size > 0) {
+            fctx->lazy_bytecode = sqlite3_malloc(bytecode_size);
+            if (!fctx->lazy_bytecode) {
+                sqlite3_result_error_nomem(context);
+                functionjs_free(fctx);
+                return false;
+            }
+            memcpy(fctx->lazy_bytecode, bytecode, bytecode_size);
+            fctx->lazy_bytecode_size = bytecode_size;
         }
-        fctx->func = func;
+    } else if (functionjs_materialize(context, fctx, bytecode, bytecode_size, (is_load) ? NULL : &blob, &blob_size) == false) {
+        functionjs_free(fctx);
+        return false;
     }
     
     int rc = SQLITE_OK;
-    if (is_scalar) rc = sqlite3_create_function_v2(sqlite3_context_db_handle(context), name, -1, SQLITE_UTF8, (void *)fctx, js_execute_scalar, NULL, NULL, js_execute_cleanup);
-    else if (is_aggregate) rc = sqlite3_create_function_v2(sqlite3_context_db_handle(context), name, -1, SQLITE_UTF8, (void *)fctx, NULL, js_execute_step, js_execute_final, js_execute_cleanup);
-    else if (is_window) rc = sqlite3_create_window_function(sqlite3_context_db_handle(context), name, -1, SQLITE_UTF8, (void *)fctx, js_execute_step, js_execute_final, js_execute_value, js_execute_inverse, js_execute_cleanup);
-    else if (is_collation) rc = sqlite3_create_collation_v2(sqlite3_context_db_handle(context), name, SQLITE_UTF8, (void *)fctx, js_execute_collation, js_execute_cleanup);
+    int text_rep = SQLITE_UTF8 | options.func_flags;
+    #ifdef SQLITE_RESULT_SUBTYPE
+    if (options.json_mode == JSON_MODE_TEXT) text_rep |= SQLITE_RESULT_SUBTYPE;
+    #endif
+    if (is_scalar) rc = sqlite3_create_function_v2(sqlite3_context_db_handle(context), name, nargs, text_rep, (void *)fctx, js_execute_scalar, NULL, NULL, js_execute_cleanup);
+    else if (is_aggregate) rc = sqlite3_create_function_v2(sqlite3_context_db_handle(context), name, -1, text_rep, (void *)fctx, NULL, js_execute_step, js_execute_final, js_execute_cleanup);
+    else if (is_window) rc = sqlite3_create_window_function(sqlite3_context_db_handle(context), name, -1, text_rep, (void *)fctx, js_execute_step, js_execute_final, js_execute_value, js_execute_inverse, js_execute_cleanup);
+    else if (is_collation) rc = sqlite3_create_collation_v2(sqlite3_context_db_handle(context), name, SQLITE_UTF8, (void *)fctx, (options.collation_key) ? js_execute_collation_key : js_execute_collation, js_execute_cleanup);
     
     if (rc == SQLITE_BUSY) {
         // Due to this: https://www3.sqlite.org/src/info/cabab62bc10568d4
@@ -900,8 +4111,11 @@ bool js_create_common (sqlite3_context *context, const char *type, const char *n
     }
     
     if ((is_load == false) && (rc == SQLITE_OK)) {
-        js_add_to_table(context, type, name, init_code, step_code, final_code, value_code, inverse_code);
+        char tag[BYTECODE_TAG_SIZE];
+        js_bytecode_tag(tag);
+        js_add_to_table(context, type, name, init_code, step_code, final_code, value_code, inverse_code, nargs, flags, blob, blob_size, tag);
     }
+    if (blob) sqlite3_free(blob);
     
     // js_execute_cleanup is automatically called in case of error
     (rc == SQLITE_OK) ? sqlite3_result_int(context, SQLITE_OK) : sqlite3_result_error_code(context, rc);
@@ -918,7 +4132,24 @@ void js_create_scalar (sqlite3_context *context, int argc, sqlite3_value **argv)
         return;
     }
     
-    js_create_common(context, FUNCTION_TYPE_SCALAR, name, NULL, code, NULL, NULL, NULL, false);
+    // optional nargs parameter (NULL or -1 means variadic with a single args array)
+    int nargs = FUNCTION_NARGS_VARIADIC;
+    if (argc > 2 && sqlite3_value_type(argv[2]) != SQLITE_NULL) {
+        if (sqlite3_value_type(argv[2]) != SQLITE_INTEGER) {
+            sqlite3_result_error(context, "The nargs parameter must be of type INTEGER", -1);
+            return;
+        }
+        nargs = sqlite3_value_int(argv[2]);
+        if (nargs < FUNCTION_NARGS_VARIADIC || nargs > sqlite3_limit(sqlite3_context_db_handle(context), SQLITE_LIMIT_FUNCTION_ARG, -1)) {
+            sqlite3_result_error(context, "The nargs parameter is out of range", -1);
+            return;
+        }
+    }
+    
+    // optional flags parameter
+    const char *flags = (argc > 3) ? sqlite_value_text(argv[3]) : NULL;
+    
+    js_create_common(context, FUNCTION_TYPE_SCALAR, name, NULL, code, NULL, NULL, NULL, nargs, flags, NULL, 0, false, false);
 }
 
 void js_create_aggregate (sqlite3_context *context, int argc, sqlite3_value **argv) {
@@ -933,7 +4164,8 @@ void js_create_aggregate (sqlite3_context *context, int argc, sqlite3_value **ar
         return;
     }
     
-    js_create_common(context, FUNCTION_TYPE_AGGREGATE, name, init_code, step_code, final_code, NULL, NULL, false);
+    const char *flags = (argc > 4) ? sqlite_value_text(argv[4]) : NULL;
+    js_create_common(context, FUNCTION_TYPE_AGGREGATE, name, init_code, step_code, final_code, NULL, NULL, FUNCTION_NARGS_VARIADIC, flags, NULL, 0, false, false);
 }
 
 void js_create_window (sqlite3_context *context, int argc, sqlite3_value **argv) {
@@ -950,7 +4182,8 @@ void js_create_window (sqlite3_context *context, int argc, sqlite3_value **argv)
         return;
     }
     
-    js_create_common(context, FUNCTION_TYPE_WINDOW, name, init_code, step_code, final_code, value_code, inverse_code, false);
+    const char *flags = (argc > 6) ? sqlite_value_text(argv[6]) : NULL;
+    js_create_common(context, FUNCTION_TYPE_WINDOW, name, init_code, step_code, final_code, value_code, inverse_code, FUNCTION_NARGS_VARIADIC, flags, NULL, 0, false, false);
 }
 
 void js_create_collation (sqlite3_context *context, int argc, sqlite3_value **argv) {
@@ -963,7 +4196,10 @@ void js_create_collation (sqlite3_context *context, int argc, sqlite3_value **ar
         return;
     }
     
-    js_create_common(context, FUNCTION_TYPE_COLLATION, name, NULL, code, NULL, NULL, NULL, false);
+    // optional flags parameter
+    const char *flags = (argc > 2) ? sqlite_value_text(argv[2]) : NULL;
+    
+    js_create_common(context, FUNCTION_TYPE_COLLATION, name, NULL, code, NULL, NULL, NULL, FUNCTION_NARGS_VARIADIC, flags, NULL, 0, false, false);
 }
 
 void js_eval (sqlite3_context *context, int argc, sqlite3_value **argv) {
@@ -980,6 +4216,144 @@ void js_eval (sqlite3_context *context, int argc, sqlite3_value **argv) {
     JS_FreeValue(data->context, value);
 }
 
+void js_stats0 (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc; (void)argv;
+    globaljs_context *js = (globaljs_context *)sqlite3_user_data(context);
+    
+    int nfunctions = 0;
+    for (functionjs_context *fctx = js->functions; fctx; fctx = fctx->next) ++nfunctions;
+    
+    // build a JSON object with the connection statistics
+    jsstmt_cache *cache = &js->stmt_cache;
+    char *json = sqlite3_mprintf("{\"functions\":%d,\"stmt_cache_capacity\":%d,\"stmt_cache_size\":%d,\"stmt_cache_hits\":%lld,\"stmt_cache_misses\":%lld}", nfunctions, cache->capacity, cache->count, cache->hits, cache->misses);
+    if (!json) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    sqlite3_result_text(context, json, -1, sqlite3_free);
+}
+
+static void js_str_append_json (sqlite3_str *str, const char *text) {
+    // JSON string literal (or null), with quotes, backslashes and control characters escaped
+    if (!text) {
+        sqlite3_str_appendall(str, "null");
+        return;
+    }
+    sqlite3_str_appendchar(str, 1, '"');
+    for (const unsigned char *p = (const unsigned char *)text; *p; ++p) {
+        if (*p == '"' || *p == '\\') sqlite3_str_appendf(str, "\\%c", *p);
+        else if (*p < 0x20) sqlite3_str_appendf(str, "\\u%04x", *p);
+        else sqlite3_str_appendchar(str, 1, (char)*p);
+    }
+    sqlite3_str_appendchar(str, 1, '"');
+}
+
+void js_stats1 (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    globaljs_context *js = (globaljs_context *)sqlite3_user_data(context);
+    
+    const char *name = sqlite_value_text(argv[0]);
+    if (!name) {
+        sqlite3_result_error(context, "A parameter of type TEXT is required", -1);
+        return;
+    }
+    
+    // lookup the most recently registered function with that name
+    functionjs_context *fctx = js->functions;
+    while (fctx && strcasecmp(fctx->name, name) != 0) fctx = fctx->next;
+    if (!fctx) {
+        sqlite3_result_null(context);
+        return;
+    }
+    
+    // build a JSON object with the function statistics
+    sqlite3_str *str = sqlite3_str_new(sqlite3_context_db_handle(context));
+    sqlite3_str_appendf(str, "{\"kind\":\"%s\",\"nargs\":%d,\"compiled\":%s", fctx->kind, fctx->nargs, (fctx->materialized) ? "true" : "false");
+    
+    jscache *cache = fctx->cache;
+    sqlite3_str_appendf(str, ",\"cache_capacity\":%d,\"cache_size\":%d,\"cache_hits\":%lld,\"cache_misses\":%lld", (cache) ? cache->capacity : 0, (cache) ? cache->count : 0, (cache) ? cache->hits : 0, (cache) ? cache->misses : 0);
+    
+    sqlite3_str_appendf(str, ",\"pool_capacity\":%d,\"pool_size\":%d,\"pool_hits\":%lld,\"pool_misses\":%lld", fctx->options.pool_size, fctx->pool_count, fctx->pool_hits, fctx->pool_misses);
+    
+    sqlite3_str_appendf(str, ",\"errors\":%lld,\"last_error\":", fctx->errors);
+    js_str_append_json(str, fctx->last_error);
+    
+    sqlite3_str_appendchar(str, 1, '}');
+    
+    int len = sqlite3_str_length(str);
+    char *json = sqlite3_str_finish(str);
+    if (!json) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    sqlite3_result_text(context, json, len, sqlite3_free);
+}
+
+void js_config (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    globaljs_context *js = (globaljs_context *)sqlite3_user_data(context);
+    
+    const char *name = sqlite_value_text(argv[0]);
+    if (!name) {
+        sqlite3_result_error(context, "The option name must be of type TEXT", -1);
+        return;
+    }
+    
+    if (strcasecmp(name, "stmt_cache") == 0) {
+        // max number of prepared statements reused by db.exec, 0 disables the cache and finalizes all cached statements
+        if (argc > 1) {
+            if (sqlite3_value_type(argv[1]) != SQLITE_INTEGER) {
+                sqlite3_result_error(context, "The option value must be of type INTEGER", -1);
+                return;
+            }
+            sqlite3_int64 capacity = sqlite3_value_int64(argv[1]);
+            if (capacity < 0 || capacity > STMT_CACHE_MAX_SIZE) {
+                sqlite3_result_error(context, "The stmt_cache option is out of range", -1);
+                return;
+            }
+            js->stmt_cache.capacity = (int)capacity;
+            jsstmt_cache_trim(&js->stmt_cache, js->stmt_cache.capacity);
+        }
+        sqlite3_result_int(context, js->stmt_cache.capacity);
+        return;
+    }
+    
+    if (strcasecmp(name, "trusted_bytecode") == 0) {
+        // 1 loads the bytecode persisted in js_functions (only for databases whose content is fully trusted)
+        if (argc > 1) {
+            if (sqlite3_value_type(argv[1]) != SQLITE_INTEGER) {
+                sqlite3_result_error(context, "The option value must be of type INTEGER", -1);
+                return;
+            }
+            js->trusted_bytecode = (sqlite3_value_int64(argv[1]) != 0);
+        }
+        sqlite3_result_int(context, (js->trusted_bytecode) ? 1 : 0);
+        return;
+    }
+    
+    if (strcasecmp(name, "trusted_blobview") == 0) {
+        // 1 lets blobview functions write to the memory of their BLOB arguments (only for fully trusted functions)
+        if (argc > 1) {
+            if (sqlite3_value_type(argv[1]) != SQLITE_INTEGER) {
+                sqlite3_result_error(context, "The option value must be of type INTEGER", -1);
+                return;
+            }
+            js->trusted_blobview = (sqlite3_value_int64(argv[1]) != 0);
+        }
+        sqlite3_result_int(context, (js->trusted_blobview) ? 1 : 0);
+        return;
+    }
+    
+    char *err_msg = sqlite3_mprintf("Unknown option '%s'", name);
+    sqlite3_result_error(context, (err_msg) ? err_msg : "Unknown option", -1);
+    if (err_msg) sqlite3_free(err_msg);
+}
+
+void js_release (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc; (void)argv;
+    globaljs_context *js = (globaljs_context *)sqlite3_user_data(context);
+    sqlite3_result_int(context, js_release_statements(js));
+}
+
 static void js_load_fromfile (sqlite3_context *context, int argc, sqlite3_value **argv, bool is_blob) {
     const char *path = (const char *)sqlite3_value_text(argv[0]);
     if (!path) {
@@ -1023,30 +4397,78 @@ void js_load_blob (sqlite3_context *context, int argc, sqlite3_value **argv) {
     js_load_fromfile(context, argc, argv, true);
 }
 
-int js_load_from_table_callback (void *xdata, int ncols, char **values, char **names) {
-    sqlite3_context *context = (sqlite3_context *)xdata;
-    assert(ncols == 7);
-    
-    const char *type = values[1];
+int js_load_from_table (sqlite3_context *context, bool is_lazy) {
+    globaljs_context *js = (globaljs_context *)sqlite3_user_data(context);
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    const char *sql = "SELECT name,kind,init_code,step_code,final_code,value_code,inverse_code,nargs,flags,bytecode,bytecode_tag FROM js_functions;";
     
-    const char *name = values[0];
-    const char *init_code = values[2];
-    const char *step_code = values[3];
-    const char *final_code = values[4];
-    const char *value_code = values[5];
-    const char *inverse_code = values[6];
+    sqlite3_stmt *vm = NULL;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    // persisted bytecode is used only if explicitly trusted and produced by the same engine build: QuickJS does not
+    // validate bytecode when reading it, so a corrupt or crafted BLOB (the table can be copied or synced between
+    // databases) could corrupt memory, and the tag and the source hash are not a protection against forgery
+    char tag[BYTECODE_TAG_SIZE];
+    js_bytecode_tag(tag);
+    
+    while ((rc = sqlite3_step(vm)) == SQLITE_ROW) {
+        const char *name = (const char *)sqlite3_column_text(vm, 0);
+        const char *type = (const char *)sqlite3_column_text(vm, 1);
+        const char *init_code = (const char *)sqlite3_column_text(vm, 2);
+        const char *step_code = (const char *)sqlite3_column_text(vm, 3);
+        const char *final_code = (const char *)sqlite3_column_text(vm, 4);
+        const char *value_code = (const char *)sqlite3_column_text(vm, 5);
+        const char *inverse_code = (const char *)sqlite3_column_text(vm, 6);
+        int nargs = (sqlite3_column_type(vm, 7) == SQLITE_NULL) ? FUNCTION_NARGS_VARIADIC : sqlite3_column_int(vm, 7);
+        const char *flags = (const char *)sqlite3_column_text(vm, 8);
+        const char *bytecode_tag = (const char *)sqlite3_column_text(vm, 10);
+        const void *bytecode = NULL;
+        int bytecode_size = 0;
+        if (js->trusted_bytecode && bytecode_tag && strcmp(bytecode_tag, tag) == 0) {
+            bytecode = sqlite3_column_blob(vm, 9);
+            bytecode_size = sqlite3_column_bytes(vm, 9);
+        }
+        
+        bool result = js_create_common(context, type, name, init_code, step_code, final_code, value_code, inverse_code, nargs, flags, bytecode, bytecode_size, true, is_lazy);
+        if (!result) {
+            sqlite3_finalize(vm);
+            return SQLITE_ERROR;
+        }
+    }
     
-    bool result = js_create_common(context, type, name, init_code, step_code, final_code, value_code, inverse_code, true);
-    return (result) ? SQLITE_OK : SQLITE_ERROR;
+    sqlite3_finalize(vm);
+    return (rc == SQLITE_DONE) ? SQLITE_OK : rc;
 }
 
-int js_load_from_table (sqlite3_context *context) {
-    sqlite3 *db = sqlite3_context_db_handle(context);
-    const char *sql = "SELECT * FROM js_functions;";
-    return sqlite3_exec(db, sql, js_load_from_table_callback, context, NULL);
+static int js_upgrade_table (sqlite3 *db) {
+    // columns added to js_functions after its first release, tables created by older versions are upgraded in place
+    const char *columns[] = {"nargs", "nargs INTEGER DEFAULT -1", "flags", "flags TEXT DEFAULT NULL", "bytecode", "bytecode BLOB DEFAULT NULL", "bytecode_tag", "bytecode_tag TEXT DEFAULT NULL"};
+    
+    sqlite3_stmt *vm = NULL;
+    int rc = sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info('js_functions') WHERE name=?1;", -1, &vm, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    size_t count = sizeof(columns) / sizeof(const char *);
+    for (size_t i=0; i<count; i+=2) {
+        sqlite3_bind_text(vm, 1, columns[i], -1, SQLITE_STATIC);
+        rc = sqlite3_step(vm);
+        sqlite3_reset(vm);
+        if (rc == SQLITE_ROW) continue;
+        if (rc != SQLITE_DONE) break;
+        
+        char *sql = sqlite3_mprintf("ALTER TABLE js_functions ADD COLUMN %s;", columns[i+1]);
+        if (!sql) {rc = SQLITE_NOMEM; break;}
+        rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) break;
+    }
+    
+    sqlite3_finalize(vm);
+    return (rc == SQLITE_ROW || rc == SQLITE_DONE) ? SQLITE_OK : rc;
 }
 
-void js_init_table (sqlite3_context *context, bool load_functions) {
+void js_init_table (sqlite3_context *context, int load_mode) {
     sqlite3 *db = sqlite3_context_db_handle(context);
     const char *sql = "CREATE TABLE IF NOT EXISTS js_functions ("
     "name TEXT PRIMARY KEY COLLATE NOCASE," // Name of the SQLite function or collation
@@ -1055,29 +4477,35 @@ void js_init_table (sqlite3_context *context, bool load_functions) {
     "step_code TEXT DEFAULT NULL,"          // Used in all functions
     "final_code TEXT DEFAULT NULL,"         // Only for aggregate/window
     "value_code TEXT DEFAULT NULL,"         // Only for window
-    "inverse_code TEXT DEFAULT NULL"        // Only for window
+    "inverse_code TEXT DEFAULT NULL,"       // Only for window
+    "nargs INTEGER DEFAULT -1,"             // Only for scalar (-1 means variadic)
+    "flags TEXT DEFAULT NULL,"              // Registration flags (deterministic, innocuous, directonly)
+    "bytecode BLOB DEFAULT NULL,"           // Precompiled bytecode of the code columns
+    "bytecode_tag TEXT DEFAULT NULL"        // Engine build that produced bytecode (QuickJS version, pointer size, byte order)
     ");";
     
     // create table
     int rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+    if (rc == SQLITE_OK) rc = js_upgrade_table(db);
     if (rc != SQLITE_OK) {
         sqlite3_result_error_code(context, rc);
         return;
     }
     
     // load js functions from table
-    if (load_functions) rc = js_load_from_table(context);
+    if (load_mode != FUNCTION_LOAD_NONE) rc = js_load_from_table(context, (load_mode == FUNCTION_LOAD_LAZY));
     
     sqlite3_result_int(context, rc);
 }
 
 void js_init_table1 (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    bool load_functions = (sqlite3_value_int(argv[0]) != 0);
-    js_init_table(context, load_functions);
+    // 0 creates the table only, 2 registers the stored functions but compiles them on their first call
+    int load_mode = sqlite3_value_int(argv[0]);
+    js_init_table(context, (load_mode == FUNCTION_LOAD_LAZY) ? FUNCTION_LOAD_LAZY : (load_mode != 0) ? FUNCTION_LOAD_EAGER : FUNCTION_LOAD_NONE);
 }
 
 void js_init_table0 (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    js_init_table(context, false);
+    js_init_table(context, FUNCTION_LOAD_NONE);
 }
 
 // MARK: -
@@ -1098,9 +4526,9 @@ APIEXPORT int sqlite3_js_init (sqlite3 *db, char **pzErrMsg, const sqlite3_api_r
     globaljs_context *js = globaljs_init(db);
     if (!js) return SQLITE_NOMEM;
     
-    const char *f_name[] = {"js_version", "js_version", "js_create_scalar", "js_create_aggregate", "js_create_window", "js_create_collation", "js_eval", "js_load_text", "js_load_blob", "js_init_table", "js_init_table"};
-    const void *f_ptr[] = {js_version0, js_version1, js_create_scalar, js_create_aggregate, js_create_window, js_create_collation, js_eval, js_load_text, js_load_blob, js_init_table0, js_init_table1};
-    int f_arg[] = {0, 1, 2, 4, 6, 2, 1, 1, 1, 0, 1};
+    const char *f_name[] = {"js_version", "js_version", "js_create_scalar", "js_create_scalar", "js_create_scalar", "js_create_aggregate", "js_create_aggregate", "js_create_window", "js_create_window", "js_create_collation", "js_create_collation", "js_eval", "js_stats", "js_stats", "js_config", "js_config", "js_release", "js_load_text", "js_load_blob", "js_init_table", "js_init_table"};
+    const void *f_ptr[] = {js_version0, js_version1, js_create_scalar, js_create_scalar, js_create_scalar, js_create_aggregate, js_create_aggregate, js_create_window, js_create_window, js_create_collation, js_create_collation, js_eval, js_stats0, js_stats1, js_config, js_config, js_release, js_load_text, js_load_blob, js_init_table0, js_init_table1};
+    int f_arg[] = {0, 1, 2, 3, 4, 4, 5, 6, 7, 2, 3, 1, 0, 1, 1, 2, 0, 1, 1, 0, 1};
     
     size_t f_count = sizeof(f_name) / sizeof(const char *);
     for (size_t i=0; i<f_count; ++i) {
@@ -1117,5 +4545,13 @@ APIEXPORT int sqlite3_js_init (sqlite3 *db, char **pzErrMsg, const sqlite3_api_r
         }
     }
     
+    // the module is released after the functions (and after its table is disconnected), so it keeps a reference too
+    js->ref_count++;
+    int rc = sqlite3_create_module_v2(db, JS_CLOSE_HOOK_NAME, &js_close_hook_module, (void *)js, globaljs_dec_and_free_if_needed);
+    if (rc != SQLITE_OK) {
+        if (pzErrMsg) *pzErrMsg = sqlite3_mprintf("Error creating module %s: %s", JS_CLOSE_HOOK_NAME, sqlite3_errmsg(db));
+        return rc;
+    }
+    
     return SQLITE_OK;
 }
@@ -6,6 +6,8 @@
 //
 
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include "sqlite3.h"
 #include "sqlitejs.h"
 
@@ -27,7 +29,7 @@ int db_exec (sqlite3 *db, const char *sql) {
 
 // MARK: -
 
-int test_serialization (const char *db_path, bool load_functions, int nstep) {
+int test_serialization (const char *db_path, int load_mode, int nstep) {
     sqlite3 *db = NULL;
     int rc = sqlite3_open(db_path, &db);
     if (rc != SQLITE_OK) goto abort_test;
@@ -43,7 +45,11 @@ int test_serialization (const char *db_path, bool load_functions, int nstep) {
     if (rc != SQLITE_OK) goto abort_test;
     #endif
     
-    rc = db_exec(db, (load_functions) ? "SELECT js_init_table(1);" : "SELECT js_init_table();");
+    // persisted bytecode is loaded only when trusted
+    if (load_mode == 1) rc = db_exec(db, "SELECT js_config('trusted_bytecode', 1);");
+    if (rc != SQLITE_OK) goto abort_test;
+    
+    rc = db_exec(db, (load_mode == 2) ? "SELECT js_init_table(2);" : (load_mode == 1) ? "SELECT js_init_table(1);" : "SELECT js_init_table();");
     if (rc != SQLITE_OK) goto abort_test;
     
     printf("Step %d...\n", nstep);
@@ -58,6 +64,12 @@ int test_serialization (const char *db_path, bool load_functions, int nstep) {
     }
     if (nstep == 3) {
         rc = db_exec(db, "SELECT SuperFunction(123), SuperFunction(12.3);");
+        if (rc == SQLITE_OK) rc = db_exec(db, "SELECT name, bytecode_tag, length(bytecode) > 0 FROM js_functions;");
+    }
+    if (nstep == 4) {
+        rc = db_exec(db, "SELECT json_extract(js_stats('SuperFunction'), '$.compiled');");
+        if (rc == SQLITE_OK) rc = db_exec(db, "SELECT SuperFunction(123), SuperFunction(12.3);");
+        if (rc == SQLITE_OK) rc = db_exec(db, "SELECT json_extract(js_stats('SuperFunction'), '$.compiled');");
     }
     if (rc != SQLITE_OK) goto abort_test;
     printf("\n");
@@ -97,6 +109,28 @@ int test_execution (void) {
     rc = db_exec(db, "SELECT js_eval('136*10');");
     rc = db_exec(db, "SELECT js_eval('Math.cos(13);');");
     rc = db_exec(db, "SELECT js_eval('Math.random();');");
+    rc = db_exec(db, "SELECT js_config('stmt_cache', 8);");
+    rc = db_exec(db, "SELECT js_eval('JSON.stringify(db.exec(\"SELECT ?1 + ?2, ?3\", 40, 2, \"x\").toArray())');");
+    rc = db_exec(db, "SELECT js_eval('db.exec(\"SELECT :a || @b\", {a: \"foo\", b: \"bar\"}).toArray()[0][0]');");
+    rc = db_exec(db, "SELECT js_eval('db.exec(\"SELECT :a || @b\", {a: \"bar\", b: \"foo\"}).toArray()[0][0]');");
+    rc = db_exec(db, "SELECT js_eval('try { db.exec(\"SELECT :a || @b\", {a: \"bar\"}); \"bound\" } catch (e) { e.message }'), js_eval('db.exec(\"SELECT typeof(?), typeof(?), typeof(:c)\", [2 ** 40, 0.5, undefined]).toArray()[0].join()');");
+    rc = db_exec(db, "SELECT js_eval('JSON.stringify(db.exec(\"SELECT 1 AS a, 2.5 AS b UNION ALL SELECT 2, 3.5\").toObjects())');");
+    rc = db_exec(db, "SELECT js_eval('JSON.stringify(db.exec(\"SELECT 1 AS a, 2.5 AS b, NULL AS c UNION ALL SELECT 2, ''x'', 3\").toColumns().map(c => [c.name, c.type, Array.from(c.values), Array.from(c.nulls)]))');");
+    rc = db_exec(db, "SELECT js_eval('var r = db.exec(\"WITH RECURSIVE s(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM s WHERE x < 5) SELECT x, x * 2 FROM s\"); JSON.stringify([r.nextBatch(2), r.nextBatch(2, true), r.nextBatch(2), r.nextBatch(2)])');");
+    rc = db_exec(db, "SELECT js_eval('var r = db.exec(\"SELECT 1 UNION ALL SELECT abs(-9223372036854775808)\"); try { r.nextBatch(4, true); } catch (e) { e.message }');");
+    rc = db_exec(db, "SELECT js_eval('var r = db.exec(\"WITH RECURSIVE s(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM s WHERE x < 1000) SELECT x, -x FROM s\"); var b = r.nextBatch(16384, true); [b.length, b[1998], r.nextBatch(16384).length].join()');");
+    rc = db_exec(db, "SELECT js_eval('var out = []; for (const r of db.exec(\"SELECT 1 AS a, 2 AS b UNION ALL SELECT 3, 4\").rows({objects: true, reuse: true})) out.push(r.a + r.b); for (const r of db.exec(\"SELECT 5\")) out.push(r[0]); JSON.stringify(out)');");
+    rc = db_exec(db, "SELECT js_eval('var out = []; try { for (const r of db.exec(\"SELECT 1 UNION ALL SELECT abs(-9223372036854775808)\")) out.push(r[0]); } catch (e) { out.push(e.message) } JSON.stringify(out)');");
+    rc = db_exec(db, "SELECT js_eval('try { db.exec(\"SELECT 1 AS a UNION ALL SELECT abs(-9223372036854775808)\").toObjects(); } catch (e) { e.message }');");
+    rc = db_exec(db, "SELECT js_eval('JSON.stringify(db.exec(\"SELECT 9007199254740993 AS a UNION ALL SELECT ''x''\").toColumns().map(c => [c.type, typeof c.values[0]]))');");
+    rc = db_exec(db, "SELECT js_eval('try { db.exec(\"SELECT 1 AS a UNION ALL SELECT abs(-9223372036854775808)\").toColumns(); } catch (e) { e.message }');");
+    rc = db_exec(db, "SELECT js_eval('var out = [db.exec(\"SELECT ?1\", -(2n ** 63n)).toArray()[0][0] === -(2 ** 63)]; try { db.exec(\"SELECT ?1\", 2n ** 64n + 5n); } catch (e) { out.push(e.name + \": \" + e.message) } JSON.stringify(out)');");
+    rc = db_exec(db, "SELECT js_stats();");
+    rc = db_exec(db, "SELECT js_config('stmt_cache', 0);");
+    rc = db_exec(db, "SELECT js_create_scalar('Twice2', '(function(){ const st = db.prepare(\"SELECT ?1 * 2\"); return function(n){ return st.all(n)[0][0]; }; })()', 1);");
+    rc = db_exec(db, "SELECT Twice2(21), Twice2(50);");
+    rc = db_exec(db, "SELECT js_eval('var out = []; for (const sql of [\"SELECT 1; -- done\", \"SELECT 1; SELECT 2\"]) { try { const st = db.prepare(sql); out.push(st.all()); st.finalize(); } catch (e) { out.push(e.message) } } JSON.stringify(out)');");
+    rc = db_exec(db, "SELECT js_release();");
     
     // scalar
     printf("\nTesting js_create_scalar\n");
@@ -104,6 +138,38 @@ int test_execution (void) {
     rc = db_exec(db, "SELECT Cos(123), cos(12.3);");
     rc = db_exec(db, "SELECT js_create_scalar('Sin', '(function(args){return Math.sin(args[0]);})')");
     rc = db_exec(db, "SELECT Sin(123), sin(12.3);");
+    rc = db_exec(db, "SELECT js_create_scalar('Sum2', '(function(a, b){return a + b;})', 2)");
+    rc = db_exec(db, "SELECT Sum2(40, 2), Sum2('a', 'b');");
+    rc = db_exec(db, "SELECT Sum2('a' || char(0) || 'b', 'c') = 'a' || char(0) || 'bc', hex(js_eval('\"x\" + String.fromCharCode(0) + \"y\"'));");
+    rc = db_exec(db, "SELECT js_create_scalar('Fold', '(function(s){return s.toLowerCase();})', 1, 'deterministic, innocuous')");
+    rc = db_exec(db, "CREATE TABLE words(w TEXT); CREATE INDEX words_fold ON words(Fold(w)); INSERT INTO words VALUES ('Hello'), ('WORLD');");
+    rc = db_exec(db, "SELECT w FROM words WHERE Fold(w) = 'world';");
+    rc = db_exec(db, "SELECT js_create_scalar('Twice', '(function(n){return n * 2;})', 1, 'deterministic, cache=2')");
+    rc = db_exec(db, "WITH v(n) AS (VALUES (1), (2), (1), (3), (1), (2.5)) SELECT Twice(n) FROM v;");
+    rc = db_exec(db, "SELECT js_stats('Twice');");
+    rc = db_exec(db, "SELECT js_create_scalar('Triangle', '(function(n){return n <= 1 ? n : n + db.exec(\"SELECT Triangle(?1)\", n - 1).toArray()[0][0];})', 1, 'deterministic, cache')");
+    rc = db_exec(db, "SELECT Triangle(4), Triangle(3), Triangle(2), Triangle(1);");
+    rc = db_exec(db, "SELECT js_create_scalar('Volatile', '(function(n){return n;})', 1, 'cache')");
+    rc = db_exec(db, "SELECT js_create_scalar('NextId', '(function(id){return id + 1n;})', 1, 'bigint')");
+    rc = db_exec(db, "SELECT NextId(9223372036854775806), typeof(js_eval('2 ** 40')), js_eval('2n ** 62n');");
+    rc = db_exec(db, "SELECT js_create_scalar('Pow2', '(function(n){return 2 ** n;})', 1, 'bigint')");
+    rc = db_exec(db, "SELECT typeof(Pow2(40)), typeof(Pow2(0.5)), typeof(js_eval('2 ** 31')), typeof(js_eval('7'));");
+    rc = db_exec(db, "SELECT js_create_scalar('Half', '(function(n){return n / 2;})', 1, 'returns=integer')");
+    rc = db_exec(db, "SELECT Half(5), typeof(Half(5)), Half(NULL), typeof(js_eval('1.5 + 2.5'));");
+    rc = db_exec(db, "SELECT js_create_scalar('Tail', '(function(b){globalThis.kept = b; return new Uint8Array(b, 1);})', 1, 'blobview')");
+    rc = db_exec(db, "SELECT hex(Tail(x'01020304')), length(Tail(x'01')), js_eval('kept.byteLength');");
+    rc = db_exec(db, "SELECT js_config('trusted_blobview', 1), hex(Tail(x'01020304')), length(Tail(x'01')), js_eval('kept.byteLength'), js_config('trusted_blobview', 0);");
+    rc = db_exec(db, "SELECT js_create_scalar('NextDay', '(function(d){return new Date(d.getTime() + 86400000);})', 1, 'date')");
+    rc = db_exec(db, "SELECT NextDay('2024-02-28'), NextDay('2024-12-31T23:59:59.5+01:00'), NextDay(0);");
+    rc = db_exec(db, "SELECT js_create_scalar('DateKind', '(function(d){return (d instanceof Date) ? d.toISOString() : \"text \" + d;})', 1, 'date')");
+    rc = db_exec(db, "SELECT group_concat(DateKind(column1), ', ') FROM (VALUES ('2024-02-29'), ('2023-02-29'), ('2024-04-31'), ('2024-01-01T24:00:00'), ('2024-01-01T24:00'), ('2024-01-01T24:30:00'), ('2024-01-01T10:00+14:00'), ('2024-01-01T10:00+15:00'));");
+    rc = db_exec(db, "SELECT js_create_scalar('Tagged', '(function(o){o.tagged = true; return o;})', 1, 'json')");
+    rc = db_exec(db, "SELECT Tagged('{\"a\":[1,2.5,\"x\"]}'), json_array(Tagged('[]')), Tagged('not json');");
+    rc = db_exec(db, "SELECT js_create_scalar('TaggedB', '(function(o){o.tagged = true; return o;})', 1, 'jsonb')");
+    rc = db_exec(db, "SELECT hex(TaggedB('{\"a\":1}')), hex(TaggedB(TaggedB('{}')));");
+    rc = db_exec(db, "SELECT js_create_scalar('BigA', '(function(o){return (o instanceof ArrayBuffer) ? \"blob\" : typeof o.a + \" \" + o.a;})', 1, 'json, bigint')");
+    rc = db_exec(db, "SELECT js_create_scalar('SafeA', '(function(o){return (o instanceof ArrayBuffer) ? \"blob\" : typeof o.a + \" \" + o.a;})', 1, 'jsonb, bigint')");
+    rc = db_exec(db, "SELECT BigA('{\"a\":9007199254740993}'), SafeA(X'CC141761C31039303037313939323534373430393933'), SafeA(X'4C17611332'), SafeA(X'7C17614430783146'), SafeA(X'9C1761652D312E356533'), SafeA(X'CC181761C4142D30783130303030303030303030303030303030');");
     
     // aggregate
     printf("\nTesting js_create_aggregate\n");
@@ -113,6 +179,17 @@ int test_execution (void) {
     rc = db_exec(db, "SELECT Median(val) FROM data;");
     rc = db_exec(db, "INSERT INTO data(val) VALUES (10), (12), (14), (16), (18), (20);");
     rc = db_exec(db, "SELECT Median(val) FROM data;");
+    rc = db_exec(db, "SELECT val % 2 AS k, Median(val) FROM data GROUP BY k;");
+    rc = db_exec(db, "SELECT js_stats('Median');");
+    rc = db_exec(db, "SELECT js_create_aggregate('CountSeen', 'var seen; if (!seen) seen = new Set();', '(function(){ const vals = []; return function(args){ vals.push(args[0]); seen.add(args[0]); }; })()', '(function(){ return seen.size; })', 'pool');");
+    rc = db_exec(db, "SELECT val % 3 AS k, CountSeen(val) FROM data GROUP BY k;");
+    rc = db_exec(db, "SELECT js_create_aggregate('CountLet', 'let seen = new Set();', '(function(args){ seen.add(args[0]); })', '(function(){ return seen.size; })', 'pool');");
+    rc = db_exec(db, "SELECT val % 3 AS k, CountLet(val) FROM data GROUP BY k;");
+    rc = db_exec(db, "SELECT json_extract(js_stats('CountLet'), '$.pool_capacity'), json_extract(js_stats('CountLet'), '$.errors'), json_extract(js_stats('CountLet'), '$.last_error');");
+    rc = db_exec(db, "SELECT js_stats('CountSeen');");
+    rc = db_exec(db, "SELECT js_create_aggregate('Mean', '(function(){return {sum: 0, n: 0};})', '(function(state, args){state.sum += args[0]; state.n++;})', '(function(state){return state.n ? state.sum / state.n : null;})', 'state');");
+    rc = db_exec(db, "SELECT val % 3 AS k, Mean(val) FROM data GROUP BY k;");
+    rc = db_exec(db, "SELECT Mean(val) FROM data WHERE val < 0;");
     
     // db object
     printf("\nTesting db.exec\n");
@@ -151,6 +228,24 @@ int test_execution (void) {
     printf("\nCustom collation (A_FIRST):\n");
     rc = db_exec(db, "SELECT name FROM test ORDER BY name COLLATE A_FIRST;");
     
+    printf("\nKey collation (LOWER_KEY):\n");
+    rc = db_exec(db, "SELECT js_create_collation('LOWER_KEY', '(function(s){return s.toLowerCase();})', 'key');");
+    rc = db_exec(db, "SELECT name FROM test ORDER BY name COLLATE LOWER_KEY;");
+    
+    printf("\nASCII collation (UNICODE_NOCASE):\n");
+    rc = db_exec(db, "SELECT js_create_collation('UNICODE_NOCASE', '(function(a, b){a = a.toLowerCase(); b = b.toLowerCase(); return a < b ? -1 : a > b ? 1 : 0;})', 'nocase');");
+    rc = db_exec(db, "SELECT group_concat(name, ' ') FROM (SELECT name FROM test UNION ALL SELECT '\xC3\x89" "clair' ORDER BY name COLLATE UNICODE_NOCASE);");
+    
+    printf("\nFailing collation (STRICT):\n");
+    rc = db_exec(db, "SELECT js_create_collation('STRICT', '(function(a, b){if (a === ''Zebra'' || b === ''Zebra'') throw new Error(''no zebras''); return a < b ? -1 : a > b ? 1 : 0;})');");
+    rc = db_exec(db, "SELECT group_concat(name, ' ') FROM (SELECT name FROM test ORDER BY name COLLATE STRICT);");
+    rc = db_exec(db, "SELECT json_extract(js_stats('STRICT'), '$.errors') > 0, json_extract(js_stats('STRICT'), '$.last_error');");
+    rc = db_exec(db, "SELECT js_create_collation('STRICT_ABORT', '(function(a, b){if (a === ''Zebra'' || b === ''Zebra'') throw new Error(''no zebras''); return a < b ? -1 : a > b ? 1 : 0;})', 'abort');");
+    rc = db_exec(db, "SELECT name FROM test ORDER BY name COLLATE STRICT_ABORT;");
+    printf("Expected interruption: %s\n", (rc == SQLITE_INTERRUPT) ? "yes" : "no");
+    rc = db_exec(db, "SELECT js_eval('var out = []; try { out.push(db.exec(\"SELECT name FROM test ORDER BY name COLLATE STRICT\").toArray()); } catch (e) { out.push(e.message) } out.push(db.exec(\"SELECT 1\").toArray()); JSON.stringify(out)');");
+    rc = db_exec(db, "SELECT js_eval('const st = db.prepare(\"SELECT name FROM test ORDER BY name COLLATE STRICT\"); var out = []; try { out.push(st.step()); } catch (e) { out.push(e.message) } st.finalize(); JSON.stringify(out)'), 1;");
+    
     // window
     printf("\nTesting js_create_window\n");
     rc = db_exec(db, "SELECT js_create_window('sumint', 'sum = 0;', '(function(args){sum += args[0];})', '(function(){return sum;})', '(function(){return sum;})', '(function(args){sum -= args[0];})');");
@@ -164,21 +259,85 @@ int test_execution (void) {
     
     rc = db_exec(db, "SELECT x, sumint(y) OVER (ORDER BY x ROWS BETWEEN 1 PRECEDING AND 1 FOLLOWING) AS sum_y FROM t3 ORDER BY x;");
     
+    rc = db_exec(db, "SELECT js_create_window('sumstate', NULL, '(function(s, args){s.sum = (s.sum || 0) + args[0];})', '(function(s){return s.sum;})', '(function(s){return s.sum;})', '(function(s, args){s.sum -= args[0];})', 'state');");
+    rc = db_exec(db, "SELECT x, sumstate(y) OVER (ORDER BY x ROWS BETWEEN 1 PRECEDING AND 1 FOLLOWING) AS sum_y FROM t3 ORDER BY x;");
+    
+    // statements left alive by JS are finalized when the connection is closed
+    printf("\nTesting close with live statements\n");
+    rc = db_exec(db, "CREATE TABLE js_close_hook(x); SELECT count(*) FROM js_close_hook;");
+    rc = db_exec(db, "SELECT js_config('stmt_cache', 4), js_eval('db.exec(\"SELECT 1\").toArray(); globalThis.kept = db.prepare(\"SELECT 2\"); 0');");
+    if (rc != SQLITE_OK) goto abort_test;
+    rc = db_exec(db, "SELECT * FROM sqlite_js_close_hook;");
+    printf("Expected failure: %s\n", (rc != SQLITE_OK) ? "yes" : "no");
+    rc = SQLITE_OK;
+    if (rc != SQLITE_OK) goto abort_test;
+    rc = sqlite3_close(db);
+    printf("sqlite3_close: %s\n", sqlite3_errstr(rc));
+    if (rc == SQLITE_OK) db = NULL;
+    
 abort_test:
     if (rc != SQLITE_OK) printf("Error: %s\n", sqlite3_errmsg(db));
     if (db) sqlite3_close(db);
     return rc;
 }
 
+int bench_exec (sqlite3 *db, const char *label, const char *sql, double mbytes) {
+    clock_t start = clock();
+    int rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+    double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+    
+    if (rc != SQLITE_OK) printf("Error while executing %s: %s\n", sql, sqlite3_errmsg(db));
+    else printf("%-28s %8.3fs %10.1f MB/s\n", label, elapsed, (elapsed > 0) ? mbytes / elapsed : 0);
+    return rc;
+}
+
+int test_string_throughput (void) {
+    // ASCII strings marshalled from SQLite to JS (length) and back (identity), short and long values
+    sqlite3 *db = NULL;
+    int rc = sqlite3_open(":memory:", &db);
+    if (rc != SQLITE_OK) goto abort_bench;
+    
+    #if JS_LOAD_EMBEDDED
+    rc = sqlite3_js_init(db, NULL, NULL);
+    #else
+    rc = sqlite3_enable_load_extension(db, 1);
+    if (rc != SQLITE_OK) goto abort_bench;
+    
+    rc = sqlite3_exec(db, "SELECT load_extension('./dist/js');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto abort_bench;
+    #endif
+    
+    printf("\nTesting string throughput\n");
+    rc = sqlite3_exec(db, "SELECT js_create_scalar('slen', '(function(s){return s.length;})', 1);"
+                          "SELECT js_create_scalar('same', '(function(s){return s;})', 1);"
+                          "CREATE TABLE short AS WITH RECURSIVE c(n) AS (SELECT 1 UNION ALL SELECT n + 1 FROM c WHERE n < 200000) SELECT printf('%08d-%07d', n, n) AS s FROM c;"
+                          "CREATE TABLE long AS WITH RECURSIVE c(n) AS (SELECT 1 UNION ALL SELECT n + 1 FROM c WHERE n < 1024) SELECT printf('%.*c', 65536, 'x') AS s FROM c;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto abort_bench;
+    
+    rc = bench_exec(db, "short ASCII (16 bytes) in", "SELECT sum(slen(s)) FROM short;", 200000.0 * 16 / 1048576);
+    rc = bench_exec(db, "short ASCII (16 bytes) round", "SELECT sum(length(CAST(same(s) AS BLOB))) FROM short;", 200000.0 * 16 / 1048576);
+    rc = bench_exec(db, "long ASCII (64 KB) in", "SELECT sum(slen(s)) FROM long;", 1024.0 * 65536 / 1048576);
+    rc = bench_exec(db, "long ASCII (64 KB) round", "SELECT sum(length(CAST(same(s) AS BLOB))) FROM long;", 1024.0 * 65536 / 1048576);
+    
+abort_bench:
+    if (rc != SQLITE_OK) printf("Error: %s\n", sqlite3_errmsg(db));
+    if (db) sqlite3_close(db);
+    return rc;
+}
+
 // MARK: -
 
-int main (void) {
+int main (int argc, char *argv[]) {
     printf("SQLite-JS version: %s (engine: %s)\n\n", sqlitejs_version(), quickjs_version());
+    
+    // benchmarks run only on request (make bench)
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) return test_string_throughput();
 
     int rc = test_execution();
-    rc = test_serialization(DB_PATH, false, 1); // create and execute original implementations
-    rc = test_serialization(DB_PATH, false, 2); // update functions previously registered in the js_functions table
-    rc = test_serialization(DB_PATH, true,  3); // load the new implementations
+    rc = test_serialization(DB_PATH, 0, 1); // create and execute original implementations
+    rc = test_serialization(DB_PATH, 0, 2); // update functions previously registered in the js_functions table
+    rc = test_serialization(DB_PATH, 1, 3); // load the new implementations
+    rc = test_serialization(DB_PATH, 2, 4); // register the new implementations and compile them on first call
     
     sqlite3_int64 current = 0;
     sqlite3_int64 highwater = 0;